@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <pthread.h>
+
+#include "event.h"
+#include "exchange.h"
+#include "ring.h"
+
+/*
+ * Задержка от болтуна до наблюдателя: болтун с заданным интервалом ставит
+ * на событие метку времени и отправляет его через кольцо (программа 4)
+ * или очередь сообщений (программа 3), наблюдатель спит в ожидании так же,
+ * как observer4/observer3, и считает разницу с моментом получения.
+ */
+#define SHM_NAME "/bench_latency"
+#define MQ_NAME "/bench_latency_mq"
+#define LOG_CAP 1024
+
+typedef struct {
+    exchange_t *ex;
+    mqd_t mq;
+    unsigned long expected;
+    uint64_t *latencies;
+    unsigned long received;
+    atomic_int ready;
+} observer_t;
+
+static void *ring_observer(void *arg) {
+    observer_t *o = arg;
+    exchange_t *ex = o->ex;
+    unsigned long cursor = ring_head(ex);
+    int slot = ring_observer_register(ex, cursor, NULL);
+    atomic_store(&o->ready, 1);
+    event_record_t ev;
+
+    while (o->received < o->expected) {
+        unsigned long head = ring_head(ex);
+        if (cursor >= head) {
+            if (atomic_load(&ex->stop_flag)) break;
+            ring_wait(ex, cursor, 100);
+            continue;
+        }
+        if (head - cursor > ex->log_capacity) cursor = head - ex->log_capacity;
+        int rc = ring_read(ex, cursor, &ev, sizeof(ev));
+        if (rc == RING_READ_PENDING) continue;
+        if (rc == RING_READ_OK) o->latencies[o->received++] = event_now_ns() - ev.timestamp_ns;
+        ring_observer_advance(ex, slot, ++cursor);
+    }
+    ring_observer_unregister(ex, slot);
+    return NULL;
+}
+
+static void *mq_observer(void *arg) {
+    observer_t *o = arg;
+    char buffer[sizeof(event_batch_t) + sizeof(event_record_t)];
+    atomic_store(&o->ready, 1);
+    while (o->received < o->expected) {
+        ssize_t bytes = mq_receive(o->mq, buffer, sizeof(buffer), NULL);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        const event_batch_t *batch = (const event_batch_t *)buffer;
+        if (batch->count == 0) break;
+        o->latencies[o->received++] = event_now_ns() - batch->events[0].timestamp_ns;
+    }
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *sorted, unsigned long count, double p) {
+    if (count == 0) return 0.0;
+    unsigned long index = (unsigned long)(p * (count - 1));
+    return sorted[index] / 1000.0;
+}
+
+static void run(const char *transport, unsigned long events, unsigned interval_us) {
+    observer_t o = {0};
+    o.expected = events;
+    o.latencies = calloc(events, sizeof(uint64_t));
+    if (!o.latencies) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    int use_ring = strcmp(transport, "ring") == 0;
+    mqd_t tx = (mqd_t)-1;
+    if (use_ring) {
+        exchange_layout_t layout = {
+            .capacity = 64,
+            .log_capacity = LOG_CAP,
+            .log_entry_size = sizeof(exchange_log_slot_t) + sizeof(event_record_t),
+            .backpressure = RING_DROP,
+        };
+        if (exchange_create(SHM_NAME, &layout, 0) == -1) exit(EXIT_FAILURE);
+        o.ex = exchange_attach(SHM_NAME);
+        if (!o.ex) exit(EXIT_FAILURE);
+    } else {
+        struct mq_attr attr = {0};
+        attr.mq_maxmsg = 10;
+        attr.mq_msgsize = (long)event_batch_size(1);
+        mq_unlink(MQ_NAME);
+        o.mq = mq_open(MQ_NAME, O_CREAT | O_RDONLY, 0600, &attr);
+        tx = mq_open(MQ_NAME, O_WRONLY);
+        if (o.mq == (mqd_t)-1 || tx == (mqd_t)-1) {
+            perror("mq_open");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, use_ring ? ring_observer : mq_observer, &o) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    while (!atomic_load(&o.ready)) sched_yield();
+
+    char buffer[sizeof(event_batch_t) + sizeof(event_record_t)] = {0};
+    event_batch_t *batch = (event_batch_t *)buffer;
+    batch->count = 1;
+    uint64_t start = event_now_ns();
+    for (unsigned long i = 0; i < events; ++i) {
+        uint64_t due = start + i * (uint64_t)interval_us * 1000;
+        struct timespec ts = { (time_t)(due / 1000000000ull), (long)(due % 1000000000ull) };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        }
+        event_record_t *ev = &batch->events[0];
+        ev->type = EVENT_CALL;
+        ev->sequence = i;
+        ev->timestamp_ns = event_now_ns();
+        if (use_ring) {
+            ring_append(o.ex, ev, sizeof(*ev), (uint32_t)ev->talker, ev->type);
+        } else if (mq_send(tx, buffer, sizeof(buffer), 0) == -1) {
+            perror("mq_send");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (use_ring) {
+        o.ex->stop_flag = 1;
+        ring_wake_all(o.ex);
+    } else {
+        batch->count = 0;
+        mq_send(tx, buffer, sizeof(event_batch_t), 0);
+    }
+    pthread_join(thread, NULL);
+
+    qsort(o.latencies, o.received, sizeof(uint64_t), compare_u64);
+    printf("%s,%lu,%u,%lu,%.1f,%.1f,%.1f,%.1f,%.1f\n", transport, events, interval_us, o.received,
+           percentile_us(o.latencies, o.received, 0.50), percentile_us(o.latencies, o.received, 0.90),
+           percentile_us(o.latencies, o.received, 0.99), percentile_us(o.latencies, o.received, 0.999),
+           o.received ? o.latencies[o.received - 1] / 1000.0 : 0.0);
+    fflush(stdout);
+
+    if (use_ring) {
+        exchange_detach(o.ex);
+        shm_unlink(SHM_NAME);
+    } else {
+        mq_close(tx);
+        mq_close(o.mq);
+        mq_unlink(MQ_NAME);
+    }
+    free(o.latencies);
+}
+
+int main(int argc, char *argv[]) {
+    long events = argc > 1 ? atol(argv[1]) : 20000;
+    int interval_us = argc > 2 ? atoi(argv[2]) : 50;
+    if (events < 1 || interval_us < 0) {
+        fprintf(stderr, "Использование: %s [событий] [интервал_мкс]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("transport,events,interval_us,received,p50_us,p90_us,p99_us,p999_us,max_us\n");
+    run("ring", (unsigned long)events, (unsigned)interval_us);
+    run("mq", (unsigned long)events, (unsigned)interval_us);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,164 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "reserve.h"
+
+/*
+ * Сравнение двух раскладок заголовка станции. В "packed" флаг остановки,
+ * номер для выдачи id, счётчик кольца, счётчик откатов и карта занятости
+ * лежат в одной кэш-линии (как было), в "padded" — каждый на своей.
+ * Потоки делают то же, что болтун: опрашивают stop_flag, занимают пару
+ * телефонов, публикуют событие в head и освобождают пару. Если ядро
+ * позволяет, через perf_event_open считаются промахи L1D на операцию.
+ */
+#define PHONES 256
+#define LINE 64
+
+typedef struct {
+    _Alignas(LINE) atomic_int stop_flag;
+    int next_id;
+    atomic_ulong head;
+    atomic_ulong rollbacks;
+    _Atomic uint64_t busy[PHONES / 64];
+} packed_t;
+
+typedef struct {
+    _Alignas(LINE) atomic_int stop_flag;
+    _Alignas(LINE) int next_id;
+    _Alignas(LINE) atomic_ulong head;
+    _Alignas(LINE) atomic_ulong rollbacks;
+    _Alignas(LINE) _Atomic uint64_t busy[PHONES / 64];
+} padded_t;
+
+typedef struct {
+    atomic_int *stop_flag;
+    atomic_ulong *head;
+    atomic_ulong *rollbacks;
+    _Atomic uint64_t *busy;
+} view_t;
+
+typedef struct {
+    pthread_t thread;
+    int index;
+    view_t view;
+    unsigned long ops;
+} worker_t;
+
+static int cpu_count = 1;
+
+static void *worker(void *arg) {
+    worker_t *w = arg;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->index % cpu_count, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    unsigned seed = (unsigned)w->index * 2654435761u + 1;
+    unsigned long ops = 0;
+    while (!atomic_load_explicit(w->view.stop_flag, memory_order_relaxed)) {
+        int a = rand_r(&seed) % PHONES;
+        int b = rand_r(&seed) % PHONES;
+        if (a == b) continue;
+        if (phone_bits_reserve_pair(w->view.busy, a, b, w->view.rollbacks)) {
+            atomic_fetch_add_explicit(w->view.head, 1, memory_order_relaxed);
+            phone_bits_release_pair(w->view.busy, a, b);
+        }
+        ops++;
+    }
+    w->ops = ops;
+    return NULL;
+}
+
+static int perf_open(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void run(const char *name, view_t view, int threads, int duration_ms) {
+    worker_t *workers = calloc((size_t)threads, sizeof(worker_t));
+    if (!workers) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    atomic_store(view.stop_flag, 0);
+
+    int perf_fd = perf_open();
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    for (int i = 0; i < threads; ++i) {
+        workers[i].index = i;
+        workers[i].view = view;
+        if (pthread_create(&workers[i].thread, NULL, worker, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct timespec pause = { duration_ms / 1000, (long)(duration_ms % 1000) * 1000000 };
+    nanosleep(&pause, NULL);
+    atomic_store(view.stop_flag, 1);
+
+    unsigned long ops = 0;
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        ops += workers[i].ops;
+    }
+    long long misses = -1;
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf_fd, &misses, sizeof(misses)) != sizeof(misses)) misses = -1;
+        close(perf_fd);
+    }
+
+    printf("%s,%d,%.0f,", name, threads, ops / (duration_ms / 1000.0));
+    if (misses >= 0 && ops > 0) {
+        printf("%.3f\n", (double)misses / ops);
+    } else {
+        printf("\n");
+    }
+    fflush(stdout);
+    free(workers);
+}
+
+int main(int argc, char *argv[]) {
+    cpu_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpu_count < 1) cpu_count = 1;
+    int max_threads = argc > 1 ? atoi(argv[1]) : cpu_count;
+    int duration_ms = argc > 2 ? atoi(argv[2]) : 500;
+    if (max_threads < 1 || duration_ms < 1) {
+        fprintf(stderr, "Использование: %s [макс_потоков] [мс_на_замер]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    static packed_t packed;
+    static padded_t padded;
+    view_t packed_view = { &packed.stop_flag, &packed.head, &packed.rollbacks, packed.busy };
+    view_t padded_view = { &padded.stop_flag, &padded.head, &padded.rollbacks, padded.busy };
+
+    printf("layout,threads,ops_per_sec,l1d_misses_per_op\n");
+    for (int threads = 1;; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+        run("packed", packed_view, threads, duration_ms);
+        run("padded", padded_view, threads, duration_ms);
+        if (threads == max_threads) break;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <mqueue.h>
+#include <pthread.h>
+
+#include "event.h"
+
+/*
+ * Пропускная способность отправки событий через очередь сообщений (то, что
+ * делает broadcast в talker3): отправитель без пауз упаковывает события
+ * пачками и шлёт их с O_NONBLOCK, при заполненной очереди пачка теряется,
+ * получатель в отдельном потоке вычитывает очередь как observer3.
+ */
+#define MQ_NAME "/bench_mq"
+#define QUEUE_DEPTH 10
+
+typedef struct {
+    mqd_t mq;
+    size_t msgsize;
+    unsigned long events;
+} receiver_t;
+
+static void *receiver(void *arg) {
+    receiver_t *r = arg;
+    char *buffer = malloc(r->msgsize);
+    if (!buffer) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (;;) {
+        ssize_t bytes = mq_receive(r->mq, buffer, r->msgsize, NULL);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        const event_batch_t *batch = (const event_batch_t *)buffer;
+        if (batch->count == 0) break; // пустая пачка — конец замера
+        r->events += batch->count;
+    }
+    free(buffer);
+    return NULL;
+}
+
+static void run(unsigned batch_size, int duration_ms) {
+    struct mq_attr attr = {0};
+    attr.mq_maxmsg = QUEUE_DEPTH;
+    attr.mq_msgsize = (long)event_batch_size(batch_size);
+    mq_unlink(MQ_NAME);
+    mqd_t rx = mq_open(MQ_NAME, O_CREAT | O_RDONLY, 0600, &attr);
+    mqd_t tx = mq_open(MQ_NAME, O_WRONLY | O_NONBLOCK);
+    if (rx == (mqd_t)-1 || tx == (mqd_t)-1) {
+        perror("mq_open");
+        if (errno == EINVAL) {
+            fprintf(stderr, "Глубина очереди и размер пачки ограничены /proc/sys/fs/mqueue/msg_max и msgsize_max\n");
+        }
+        exit(EXIT_FAILURE);
+    }
+
+    receiver_t r = { rx, event_batch_size(batch_size), 0 };
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, receiver, &r) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+
+    event_batch_t *batch = calloc(1, event_batch_size(batch_size));
+    if (!batch) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    unsigned long sent = 0, dropped = 0, messages = 0;
+    uint64_t start = event_now_ns();
+    uint64_t end = start + (uint64_t)duration_ms * 1000000;
+    uint64_t now = start;
+    while (now < end) {
+        for (unsigned i = 0; i < batch_size; ++i) {
+            event_record_t *ev = &batch->events[i];
+            ev->timestamp_ns = now;
+            ev->talker = 0;
+            ev->type = EVENT_CALL;
+            ev->sequence = sent + dropped + i;
+        }
+        batch->count = batch_size;
+        if (mq_send(tx, (const char *)batch, event_batch_size(batch_size), 0) == 0) {
+            sent += batch_size;
+            messages++;
+        } else if (errno == EAGAIN) {
+            dropped += batch_size;
+        } else {
+            perror("mq_send");
+            exit(EXIT_FAILURE);
+        }
+        now = event_now_ns();
+    }
+    double seconds = (now - start) / 1e9;
+
+    // Завершающую пустую пачку нужно доставить обязательно.
+    batch->count = 0;
+    struct mq_attr blocking = {0};
+    mq_setattr(tx, &blocking, NULL);
+    mq_send(tx, (const char *)batch, sizeof(event_batch_t), 0);
+    pthread_join(thread, NULL);
+
+    printf("%u,%.0f,%.0f,%.0f,%.0f\n", batch_size, sent / seconds, dropped / seconds, messages / seconds, r.events / seconds);
+    fflush(stdout);
+    free(batch);
+    mq_close(tx);
+    mq_close(rx);
+    mq_unlink(MQ_NAME);
+}
+
+int main(int argc, char *argv[]) {
+    int duration_ms = argc > 1 ? atoi(argv[1]) : 500;
+    if (duration_ms < 1) {
+        fprintf(stderr, "Использование: %s [мс_на_замер]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("batch,sent_events_per_sec,dropped_events_per_sec,messages_per_sec,received_events_per_sec\n");
+    static const unsigned batches[] = { 1, 4, 16, 64 };
+    for (size_t i = 0; i < sizeof(batches) / sizeof(batches[0]); ++i) {
+        run(batches[i], duration_ms);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,127 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "event.h"
+#include "reserve.h"
+
+/*
+ * Пропускная способность установки звонка на битовой карте занятости:
+ * потоки без пауз выбирают абонента (случайно или среди свободных),
+ * занимают пару телефонов и сразу освобождают её.
+ */
+enum { PICK_RANDOM, PICK_FREE };
+
+typedef struct {
+    pthread_t thread;
+    int index;
+    int threads;
+    int phones;
+    int policy;
+    _Atomic uint64_t *busy;
+    atomic_ulong *rollbacks;
+    atomic_int *stop;
+    unsigned long attempts;
+    unsigned long calls;
+} worker_t;
+
+static int cpu_count = 1;
+
+static void *worker(void *arg) {
+    worker_t *w = arg;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->index % cpu_count, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    unsigned seed = (unsigned)w->index * 2654435761u + 1;
+    unsigned long attempts = 0, calls = 0;
+    // Каждый поток изображает своих болтунов: id с шагом в число потоков.
+    int id = w->index % w->phones;
+    while (!atomic_load_explicit(w->stop, memory_order_relaxed)) {
+        int target;
+        if (w->policy == PICK_FREE) {
+            unsigned long random = ((unsigned long)rand_r(&seed) << 16) ^ (unsigned long)rand_r(&seed);
+            target = phone_bits_pick_free(w->busy, w->phones, id, random);
+        } else {
+            target = rand_r(&seed) % w->phones;
+            if (target == id) target = (target + 1) % w->phones;
+        }
+        attempts++;
+        if (target >= 0 && phone_bits_reserve_pair(w->busy, id, target, w->rollbacks)) {
+            phone_bits_release_pair(w->busy, id, target);
+            calls++;
+        }
+        id += w->threads;
+        if (id >= w->phones) id = w->index % w->phones;
+    }
+    w->attempts = attempts;
+    w->calls = calls;
+    return NULL;
+}
+
+static void run(int policy, int phones, int threads, int duration_ms) {
+    size_t words = ((size_t)phones + 63) / 64;
+    _Atomic uint64_t *busy = aligned_alloc(64, (words * sizeof(uint64_t) + 63) & ~(size_t)63);
+    worker_t *workers = calloc((size_t)threads, sizeof(worker_t));
+    if (!busy || !workers) {
+        perror("alloc");
+        exit(EXIT_FAILURE);
+    }
+    memset((void *)busy, 0, words * sizeof(uint64_t));
+    atomic_ulong rollbacks = 0;
+    atomic_int stop = 0;
+
+    for (int i = 0; i < threads; ++i) {
+        workers[i] = (worker_t){ .index = i, .threads = threads, .phones = phones, .policy = policy,
+                                 .busy = busy, .rollbacks = &rollbacks, .stop = &stop };
+        if (pthread_create(&workers[i].thread, NULL, worker, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    uint64_t start = event_now_ns();
+    struct timespec pause = { duration_ms / 1000, (long)(duration_ms % 1000) * 1000000 };
+    nanosleep(&pause, NULL);
+    atomic_store(&stop, 1);
+
+    unsigned long attempts = 0, calls = 0;
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        attempts += workers[i].attempts;
+        calls += workers[i].calls;
+    }
+    double seconds = (event_now_ns() - start) / 1e9;
+    printf("%s,%d,%d,%.0f,%.0f,%lu\n", policy == PICK_FREE ? "free" : "random", phones, threads,
+           calls / seconds, attempts / seconds, atomic_load(&rollbacks));
+    fflush(stdout);
+    free(workers);
+    free((void *)busy);
+}
+
+int main(int argc, char *argv[]) {
+    cpu_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpu_count < 1) cpu_count = 1;
+    int max_threads = argc > 1 ? atoi(argv[1]) : cpu_count;
+    int duration_ms = argc > 2 ? atoi(argv[2]) : 500;
+    int phones = argc > 3 ? atoi(argv[3]) : 1024;
+    if (max_threads < 1 || duration_ms < 1 || phones < 2) {
+        fprintf(stderr, "Использование: %s [макс_потоков] [мс_на_замер] [телефонов]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("policy,phones,threads,calls_per_sec,attempts_per_sec,rollbacks\n");
+    for (int policy = PICK_RANDOM; policy <= PICK_FREE; ++policy) {
+        for (int threads = 1;; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+            run(policy, phones, threads, duration_ms);
+            if (threads == max_threads) break;
+        }
+    }
+    return EXIT_SUCCESS;
+}
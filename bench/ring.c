@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "event.h"
+#include "exchange.h"
+#include "ring.h"
+
+/*
+ * Пропускная способность ring_append (то, что делает append_log в
+ * talker4): производители без пауз пишут записи событий в кольцо, а
+ * наблюдатель, если он есть, читает их так же, как observer4.
+ */
+#define SHM_NAME "/bench_ring"
+#define LOG_CAP 1024
+
+typedef struct {
+    pthread_t thread;
+    int index;
+    exchange_t *ex;
+    unsigned long count;
+    unsigned long skipped;
+} worker_t;
+
+static int cpu_count = 1;
+static atomic_int stop_requested;
+
+static void pin(int index) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % cpu_count, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void *producer(void *arg) {
+    worker_t *w = arg;
+    pin(w->index);
+    event_record_t ev = {0};
+    ev.talker = w->index;
+    ev.type = EVENT_CALL;
+    unsigned long count = 0;
+    while (!atomic_load_explicit(&stop_requested, memory_order_relaxed)) {
+        ev.sequence = count;
+        ev.timestamp_ns = event_now_ns();
+        ring_append(w->ex, &ev, sizeof(ev), (uint32_t)ev.talker, ev.type);
+        count++;
+    }
+    w->count = count;
+    return NULL;
+}
+
+static void *observer(void *arg) {
+    worker_t *w = arg;
+    pin(w->index);
+    exchange_t *ex = w->ex;
+    unsigned long cursor = ring_head(ex);
+    int slot = ring_observer_register(ex, cursor, NULL);
+    event_record_t ev;
+    unsigned long received = 0, skipped = 0;
+
+    while (!atomic_load(&ex->stop_flag)) {
+        unsigned long head = ring_head(ex);
+        if (cursor < head && head - cursor > ex->log_capacity) {
+            skipped += head - ex->log_capacity - cursor;
+            cursor = head - ex->log_capacity;
+        }
+        int rc = cursor < head ? ring_read(ex, cursor, &ev, sizeof(ev)) : RING_READ_PENDING;
+        if (rc == RING_READ_OK) {
+            received++;
+            cursor++;
+        } else if (rc == RING_READ_OVERWRITTEN) {
+            skipped++;
+            cursor++;
+        } else {
+            ring_wait(ex, cursor, 10);
+            continue;
+        }
+        ring_observer_advance(ex, slot, cursor);
+    }
+    ring_observer_unregister(ex, slot);
+    w->count = received;
+    w->skipped = skipped;
+    return NULL;
+}
+
+static void run(int backpressure, int producers, int observers, int duration_ms) {
+    exchange_layout_t layout = {
+        .capacity = 64,
+        .log_capacity = LOG_CAP,
+        .log_entry_size = sizeof(exchange_log_slot_t) + sizeof(event_record_t),
+        .backpressure = (uint32_t)backpressure,
+        .block_timeout_ms = 200,
+    };
+    if (exchange_create(SHM_NAME, &layout, 0) == -1) exit(EXIT_FAILURE);
+    exchange_t *ex = exchange_attach(SHM_NAME);
+    if (!ex) exit(EXIT_FAILURE);
+
+    int total = producers + observers;
+    worker_t *workers = calloc((size_t)total, sizeof(worker_t));
+    if (!workers) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    atomic_store(&stop_requested, 0);
+    for (int i = 0; i < total; ++i) {
+        workers[i].index = i;
+        workers[i].ex = ex;
+        if (pthread_create(&workers[i].thread, NULL, i < producers ? producer : observer, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    uint64_t start = event_now_ns();
+    struct timespec pause = { duration_ms / 1000, (long)(duration_ms % 1000) * 1000000 };
+    nanosleep(&pause, NULL);
+    atomic_store(&stop_requested, 1);
+    for (int i = 0; i < producers; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double seconds = (event_now_ns() - start) / 1e9;
+    ex->stop_flag = 1;
+    ring_wake_all(ex);
+
+    unsigned long appended = 0, received = 0, skipped = 0;
+    for (int i = 0; i < total; ++i) {
+        if (i >= producers) pthread_join(workers[i].thread, NULL);
+        if (i < producers) {
+            appended += workers[i].count;
+        } else {
+            received += workers[i].count;
+            skipped += workers[i].skipped;
+        }
+    }
+    printf("%s,%d,%d,%.0f,%.0f,%lu\n", backpressure == RING_BLOCK ? "block" : "drop", producers, observers,
+           appended / seconds, received / seconds, skipped);
+    fflush(stdout);
+    free(workers);
+    exchange_detach(ex);
+    shm_unlink(SHM_NAME);
+}
+
+int main(int argc, char *argv[]) {
+    cpu_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpu_count < 1) cpu_count = 1;
+    int max_producers = argc > 1 ? atoi(argv[1]) : cpu_count;
+    int duration_ms = argc > 2 ? atoi(argv[2]) : 500;
+    if (max_producers < 1 || duration_ms < 1) {
+        fprintf(stderr, "Использование: %s [макс_производителей] [мс_на_замер]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("backpressure,producers,observers,appends_per_sec,received_per_sec,skipped\n");
+    for (int producers = 1;; producers = producers * 2 < max_producers ? producers * 2 : max_producers) {
+        run(RING_DROP, producers, 0, duration_ms);
+        run(RING_DROP, producers, 1, duration_ms);
+        run(RING_BLOCK, producers, 1, duration_ms);
+        if (producers == max_producers) break;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,209 @@
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "lockstat.h"
+
+/*
+ * Асинхронный вывод в консоль. Строки складываются в локальное кольцо
+ * процесса без блокировок (номер слота берётся атомарным инкрементом),
+ * а фоновый поток забирает готовые строки пачками и выводит их одним
+ * writev. Межпроцессный семафор печати берёт только фоновый поток и
+ * только на время writev, поэтому строки разных процессов не смешиваются,
+ * а болтуны не ждут терминал.
+ */
+#define ASYNC_LOG_SLOTS 4096
+#define ASYNC_LOG_LINE 240
+#define ASYNC_LOG_BATCH 64
+
+typedef struct {
+    atomic_ulong seq;
+    unsigned len;
+    char text[ASYNC_LOG_LINE];
+} async_log_slot_t;
+
+static struct {
+    async_log_slot_t slots[ASYNC_LOG_SLOTS];
+    atomic_ulong head;
+    unsigned long tail;
+    atomic_uint wake;
+    atomic_int sleeping;
+    atomic_int stopping;
+    int running;
+    int registered;
+    sem_t *lock;
+    lockstat_t *lock_stat;
+    pthread_t thread;
+} async_log;
+
+static inline void async_log_wake(void) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(&async_log.sleeping, memory_order_relaxed)) return;
+    atomic_fetch_add(&async_log.wake, 1);
+    syscall(SYS_futex, &async_log.wake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static inline void async_log_write_all(struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(STDOUT_FILENO, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= (size_t)written;
+        }
+    }
+}
+
+/* Забирает все готовые строки; возвращает их число. */
+static inline int async_log_drain(void) {
+    struct iovec iov[ASYNC_LOG_BATCH];
+    int total = 0;
+
+    for (;;) {
+        int count = 0;
+        unsigned long pos = async_log.tail;
+        while (count < ASYNC_LOG_BATCH) {
+            async_log_slot_t *slot = &async_log.slots[pos % ASYNC_LOG_SLOTS];
+            if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1) break;
+            iov[count].iov_base = slot->text;
+            iov[count].iov_len = slot->len;
+            count++;
+            pos++;
+        }
+        if (count == 0) return total;
+
+        if (async_log.lock) {
+            uint64_t acquired = lockstat_wait(async_log.lock, async_log.lock_stat);
+            async_log_write_all(iov, count);
+            lockstat_post(async_log.lock, async_log.lock_stat, acquired);
+        } else {
+            async_log_write_all(iov, count);
+        }
+
+        for (unsigned long p = async_log.tail; p < pos; ++p) {
+            atomic_store_explicit(&async_log.slots[p % ASYNC_LOG_SLOTS].seq, p + ASYNC_LOG_SLOTS, memory_order_release);
+        }
+        async_log.tail = pos;
+        total += count;
+    }
+}
+
+static inline void *async_log_writer(void *arg) {
+    (void)arg;
+    for (;;) {
+        if (async_log_drain() > 0) continue;
+        if (atomic_load(&async_log.stopping)) {
+            if (async_log.tail == atomic_load(&async_log.head) && async_log_drain() == 0) break;
+            sched_yield();
+            continue;
+        }
+        atomic_store(&async_log.sleeping, 1);
+        unsigned wake = atomic_load(&async_log.wake);
+        async_log_slot_t *slot = &async_log.slots[async_log.tail % ASYNC_LOG_SLOTS];
+        if (atomic_load(&slot->seq) != async_log.tail + 1 && !atomic_load(&async_log.stopping)) {
+            syscall(SYS_futex, &async_log.wake, FUTEX_WAIT_PRIVATE, wake, NULL, NULL, 0);
+        }
+        atomic_store(&async_log.sleeping, 0);
+    }
+    return NULL;
+}
+
+/* Дописывает всё накопленное и останавливает писателя. */
+static inline void async_log_stop(void) {
+    if (!async_log.running) return;
+    atomic_store(&async_log.stopping, 1);
+    atomic_fetch_add(&async_log.wake, 1);
+    syscall(SYS_futex, &async_log.wake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    pthread_join(async_log.thread, NULL);
+    async_log.running = 0;
+}
+
+/*
+ * lock — межпроцессный семафор печати (может быть NULL), lock_stat — его
+ * гистограммы ожидания и удержания (может быть NULL). Остаток буфера
+ * выводится при async_log_stop() или, если его не вызвали, при exit().
+ */
+static inline int async_log_start(sem_t *lock, lockstat_t *lock_stat) {
+    for (unsigned long i = 0; i < ASYNC_LOG_SLOTS; ++i) {
+        atomic_init(&async_log.slots[i].seq, i);
+    }
+    atomic_init(&async_log.head, 0);
+    async_log.tail = 0;
+    atomic_init(&async_log.stopping, 0);
+    async_log.lock = lock;
+    async_log.lock_stat = lock_stat;
+
+    // Сигналы обрабатывает основной поток, писатель их не получает.
+    sigset_t blocked, previous;
+    sigfillset(&blocked);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+    int rc = pthread_create(&async_log.thread, NULL, async_log_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (rc != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+        return -1;
+    }
+    async_log.running = 1;
+    if (!async_log.registered) {
+        atexit(async_log_stop);
+        async_log.registered = 1;
+    }
+    return 0;
+}
+
+static inline void async_log_vprintf(const char *fmt, va_list args) {
+    if (!async_log.running) {
+        vprintf(fmt, args);
+        fflush(stdout);
+        return;
+    }
+    unsigned long ticket = atomic_fetch_add_explicit(&async_log.head, 1, memory_order_relaxed);
+    async_log_slot_t *slot = &async_log.slots[ticket % ASYNC_LOG_SLOTS];
+
+    // Кольцо заполнено: ждём, пока писатель освободит слот.
+    while (atomic_load_explicit(&slot->seq, memory_order_acquire) != ticket) {
+        async_log_wake();
+        sched_yield();
+    }
+    int len = vsnprintf(slot->text, sizeof(slot->text), fmt, args);
+    if (len < 0) len = 0;
+    if ((size_t)len >= sizeof(slot->text)) {
+        len = sizeof(slot->text) - 1;
+        slot->text[len - 1] = '\n';
+    }
+    slot->len = (unsigned)len;
+    atomic_store_explicit(&slot->seq, ticket + 1, memory_order_release);
+    async_log_wake();
+}
+
+static inline void async_log_printf(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    async_log_vprintf(fmt, args);
+    va_end(args);
+}
+
+#endif
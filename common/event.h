@@ -0,0 +1,77 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Событие болтуна в двоичном виде. Болтуны передают наблюдателям только
+ * эти 32 байта, а текст строится на стороне того, кто его показывает.
+ */
+enum {
+    EVENT_START,   /* target — число болтунов на станции */
+    EVENT_CALL,    /* duration — пауза перед звонком, с */
+    EVENT_HANGUP,  /* duration — длительность разговора, с */
+    EVENT_EXIT,
+    EVENT_STOP
+};
+
+typedef struct {
+    uint64_t timestamp_ns; /* CLOCK_MONOTONIC */
+    int32_t talker;
+    int32_t target;
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t duration;
+    uint64_t sequence;     /* номер события у отправителя */
+} event_record_t;
+
+/* Пачка событий в одном сообщении очереди (программа 3). */
+typedef struct {
+    uint32_t count;
+    uint32_t reserved;
+    event_record_t events[];
+} event_batch_t;
+
+static inline size_t event_batch_size(unsigned count) {
+    return sizeof(event_batch_t) + (size_t)count * sizeof(event_record_t);
+}
+
+static inline uint64_t event_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline event_record_t event_make(int type, int talker, int target, int duration) {
+    static uint64_t sequence = 0;
+    event_record_t ev = {0};
+    ev.timestamp_ns = event_now_ns();
+    ev.talker = talker;
+    ev.target = target;
+    ev.type = (uint16_t)type;
+    ev.duration = (uint32_t)duration;
+    ev.sequence = sequence++;
+    return ev;
+}
+
+/* Текст события в том же виде, в каком его раньше печатали болтуны. */
+static inline int event_render(const event_record_t *ev, char *buffer, size_t size) {
+    switch (ev->type) {
+    case EVENT_START:
+        return snprintf(buffer, size, "[%d] стартовал (болтунов=%d)\n", ev->talker, ev->target);
+    case EVENT_CALL:
+        return snprintf(buffer, size, "[%d] звонит %d (пауза %u c)\n", ev->talker, ev->target, ev->duration);
+    case EVENT_HANGUP:
+        return snprintf(buffer, size, "[%d] закончил разговор с %d за %u c\n", ev->talker, ev->target, ev->duration);
+    case EVENT_EXIT:
+        return snprintf(buffer, size, "[%d] завершает работу\n", ev->talker);
+    case EVENT_STOP:
+        return snprintf(buffer, size, "[%d] STOP\n", ev->talker);
+    default:
+        return snprintf(buffer, size, "[%d] неизвестное событие %u\n", ev->talker, ev->type);
+    }
+}
+
+#endif
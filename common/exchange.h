@@ -0,0 +1,775 @@
+#ifndef EXCHANGE_H
+#define EXCHANGE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "lockstat.h"
+#include "reserve.h"
+#include "stats.h"
+
+/*
+ * Разделяемый сегмент "телефонной станции" программ 2–4. В начале лежит
+ * заголовок с сигнатурой, версией, ёмкостью и смещениями разделов, поэтому
+ * любой процесс подключается по заголовку, не зная размеров заранее.
+ */
+#define EXCHANGE_MAGIC 0x524b4c54u /* "TLKR" */
+#define EXCHANGE_VERSION 16
+#define EXCHANGE_MAX_PHONES (1 << 24)
+#define EXCHANGE_ALIGN 64
+#define LOG_MAX_OBSERVERS 256
+/* Сколько раз снимок пытается застать строку таблицы звонков без писателя. */
+#define EXCHANGE_SNAPSHOT_TRIES 100
+/* Запас аренды сверх самого длинного разговора и период сборщика. */
+#define EXCHANGE_LEASE_GRACE_MS 5000
+#define EXCHANGE_REAP_INTERVAL_MS 1000
+/* Сколько переданная при отбое линия ждёт, пока её заберут из очереди. */
+#define EXCHANGE_HANDOFF_MS 500
+/* Сколько болтун без --init ждёт, пока другой процесс допишет заголовок. */
+#define EXCHANGE_OPEN_WAIT_MS 2000
+
+/*
+ * Отображение сегмента: EXCHANGE_MAP_PREFAULT заводит все страницы при
+ * --init и при подключении, EXCHANGE_MAP_HUGE просит прозрачные огромные
+ * страницы для shmem (если они выключены, остаются обычные).
+ */
+enum { EXCHANGE_MAP_PREFAULT = 1, EXCHANGE_MAP_HUGE = 2 };
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/* Блокировки станции, для которых ведутся гистограммы ожидания. */
+enum { EXCHANGE_LOCK_DATA, EXCHANGE_LOCK_PRINT, EXCHANGE_LOCKS };
+
+/*
+ * Поля заголовка разнесены по кэш-линиям по характеру доступа: неизменяемые
+ * после --init параметры читаются всеми, stop_flag опрашивается болтунами на
+ * каждом шаге, next_id и мьютекс выдачи номеров меняются только при старте
+ * болтуна, а счётчик откатов пишется при каждом неудачном резервировании.
+ * Счётчики сборщика и ожидания вызова занимают свои линии. Гистограммы блокировок (см.
+ * lockstat.h) тоже выровнены по линиям. Битовая карта занятости, таблица
+ * владельцев и кольцо начинаются с отдельных кэш-линий.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;
+    uint32_t capacity;
+    uint32_t header_size;
+    uint64_t busy_offset;
+    uint64_t log_offset;
+    uint32_t log_capacity;
+    uint32_t log_entry_size;
+    uint32_t queue_shards;
+    uint32_t stats_slots;
+    uint32_t exchange_index;
+    uint32_t exchange_count;
+    uint32_t map_flags;
+    uint64_t stats_offset;
+    uint64_t owners_offset;
+    uint64_t tokens_offset;
+    uint64_t waits_offset;
+    uint64_t calls_offset;
+    long long epoch_ms;
+    _Alignas(EXCHANGE_ALIGN) atomic_int stop_flag;
+    _Alignas(EXCHANGE_ALIGN) pthread_mutex_t id_lock;
+    int next_id;
+    _Alignas(EXCHANGE_ALIGN) atomic_ulong rollbacks;
+    _Alignas(EXCHANGE_ALIGN) atomic_llong reap_at_ms;
+    atomic_ulong reaped;
+    atomic_ulong lock_recoveries;
+    _Alignas(EXCHANGE_ALIGN) atomic_ulong call_waits;
+    atomic_ulong call_handoffs;
+    atomic_ulong call_wait_ns;
+    lockstat_t locks[EXCHANGE_LOCKS];
+} exchange_t;
+
+/*
+ * Очередь ожидания занятого телефона: seq — futex-слово, которое
+ * увеличивается при каждой передаче линии, waiters — число звонящих,
+ * ждущих этот телефон.
+ */
+typedef struct {
+    atomic_uint seq;
+    atomic_uint waiters;
+} exchange_wait_t;
+
+/*
+ * Фильтр наблюдателя по ключу и виду записи кольца (в программе 4 — номер
+ * болтуна и тип события). Запись проходит, если её вид отмечен в kinds,
+ * ключ лежит в [key_min, key_max] и, при ненулевой маске keys, ключ меньше
+ * 64 и отмечен в ней. kinds = 0 пропускает записи любого вида.
+ */
+typedef struct {
+    uint32_t kinds;
+    uint32_t key_min;
+    uint32_t key_max;
+    uint64_t keys;
+} exchange_filter_t;
+
+/*
+ * Строка таблицы звонков: с кем сейчас говорит телефон. Собеседник может
+ * быть на другой станции федерации (программа 2), caller отличает
+ * звонившую сторону, чтобы пара печаталась один раз. seq — номер версии
+ * строки, нечётный во время записи.
+ */
+typedef struct {
+    atomic_uint seq;
+    int32_t partner;           /* -1 — телефон не в разговоре */
+    uint32_t partner_exchange;
+    uint32_t since_ms;         /* начало разговора по exchange_clock */
+    uint32_t caller;
+} exchange_call_t;
+
+/*
+ * Зарегистрированный наблюдатель: pid владельца (0 — слот свободен, -1 —
+ * идёт регистрация), номер следующего непрочитанного события, число
+ * пропущенных им событий, его фильтр и счётчики прошедших и отсеянных
+ * фильтром записей. Каждый слот занимает свою кэш-линию.
+ */
+typedef struct {
+    _Alignas(EXCHANGE_ALIGN) atomic_int pid;
+    atomic_ulong cursor;
+    atomic_ulong skipped;
+    exchange_filter_t filter;
+    atomic_ulong matched;
+    atomic_ulong filtered;
+} exchange_observer_t;
+
+/*
+ * Кольцевой журнал (только программа 4): счётчик выданных номеров, таблица
+ * наблюдателей и слоты фиксированного размера. Каждый слот начинается со
+ * своего номера версии (см. ring.h), поэтому читатели обходятся без
+ * блокировок. backpressure задаёт поведение при отстающем наблюдателе.
+ * Счётчик head увеличивается каждым событием, поэтому он живёт на своей
+ * кэш-линии отдельно от слов пробуждения и редко меняющихся настроек.
+ */
+typedef struct {
+    _Alignas(EXCHANGE_ALIGN) atomic_ulong head;
+    _Alignas(EXCHANGE_ALIGN) atomic_uint wake;
+    atomic_uint waiters;
+    _Alignas(EXCHANGE_ALIGN) atomic_uint space;
+    atomic_uint space_waiters;
+    _Alignas(EXCHANGE_ALIGN) uint32_t backpressure;
+    uint32_t block_timeout_ms;
+    atomic_uint observer_limit;
+    exchange_observer_t observers[LOG_MAX_OBSERVERS];
+    char entries[];
+} exchange_log_t;
+
+/* Ключ и вид записи лежат рядом с номером версии, чтобы фильтр не читал данные. */
+typedef struct {
+    atomic_ulong seq;
+    uint32_t key;
+    uint32_t kind;
+    char data[];
+} exchange_log_slot_t;
+
+typedef struct {
+    uint32_t capacity;
+    uint32_t log_capacity;
+    uint32_t log_entry_size; /* полный размер слота вместе с номером версии */
+    uint32_t backpressure;
+    uint32_t block_timeout_ms;
+    uint32_t queue_shards; /* число очередей сообщений (только программа 3) */
+    uint32_t exchange_index; /* номер станции в федерации (только программа 2) */
+    uint32_t exchange_count; /* число станций в федерации, 0 — одна станция */
+    uint32_t map_flags;      /* EXCHANGE_MAP_* */
+} exchange_layout_t;
+
+static inline uint64_t exchange_align(uint64_t value) {
+    return (value + EXCHANGE_ALIGN - 1) & ~(uint64_t)(EXCHANGE_ALIGN - 1);
+}
+
+static inline uint64_t exchange_busy_words(uint32_t capacity) {
+    return ((uint64_t)capacity + 63) / 64;
+}
+
+static inline _Atomic uint64_t *exchange_busy(exchange_t *ex) {
+    return (_Atomic uint64_t *)((char *)ex + ex->busy_offset);
+}
+
+/*
+ * Владелец каждого занятого телефона: pid в старших 32 битах и срок аренды
+ * в мс от epoch_ms в младших, 0 — владельца нет. Бит в карте занятости
+ * по-прежнему решает, кто получил телефон, а метка пишется сразу после
+ * захвата и позволяет сборщику вернуть телефоны упавшего болтуна.
+ */
+static inline _Atomic uint64_t *exchange_owners(exchange_t *ex) {
+    return (_Atomic uint64_t *)((char *)ex + ex->owners_offset);
+}
+
+/*
+ * Метка звонка рядом с меткой владельца: шлюз занимает все телефоны под
+ * своим pid, и только метка отличает один звонок между станциями от
+ * другого. Пишется до метки владельца, 0 — звонок без метки.
+ */
+static inline _Atomic uint64_t *exchange_tokens(exchange_t *ex) {
+    return (_Atomic uint64_t *)((char *)ex + ex->tokens_offset);
+}
+
+static inline exchange_wait_t *exchange_waits(exchange_t *ex) {
+    return (exchange_wait_t *)((char *)ex + ex->waits_offset);
+}
+
+/*
+ * Таблица звонков: у каждой строки свой seqlock. Строку пишет только
+ * владелец телефона (болтун, шлюз или сборщик), переводя её номер версии в
+ * нечётный на время записи. Писатель, убитый посреди записи, портит только
+ * свою строку, и сборщик, забирая телефон, возвращает ей чётный номер.
+ * Читатель ничего не пишет в сегмент и не берёт блокировок.
+ */
+static inline exchange_call_t *exchange_calls(exchange_t *ex) {
+    return (exchange_call_t *)((char *)ex + ex->calls_offset);
+}
+
+static inline talker_stats_t *exchange_stats(exchange_t *ex, int id) {
+    return (talker_stats_t *)((char *)ex + ex->stats_offset) + (uint32_t)id % ex->stats_slots;
+}
+
+static inline exchange_log_t *exchange_log(exchange_t *ex) {
+    return ex->log_offset ? (exchange_log_t *)((char *)ex + ex->log_offset) : NULL;
+}
+
+static inline exchange_log_slot_t *exchange_log_slot(exchange_t *ex, unsigned long ticket) {
+    return (exchange_log_slot_t *)(exchange_log(ex)->entries + (uint64_t)(ticket % ex->log_capacity) * ex->log_entry_size);
+}
+
+static inline size_t exchange_log_payload(const exchange_t *ex) {
+    return ex->log_entry_size - sizeof(exchange_log_slot_t);
+}
+
+/* Включены ли прозрачные огромные страницы для shmem (режим не never/deny). */
+static inline int exchange_huge_available(void) {
+    char mode[128] = "";
+    FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled", "r");
+    if (!f) return 0;
+    if (!fgets(mode, sizeof(mode), f)) mode[0] = '\0';
+    fclose(f);
+    return mode[0] && !strstr(mode, "[never]") && !strstr(mode, "[deny]");
+}
+
+/*
+ * Огромные страницы нужно запросить до первого касания, поэтому сначала
+ * madvise, затем разметка всех страниц. Без MADV_POPULATE_WRITE (ядра до
+ * 5.14) страницы касаются чтением: у общего отображения shmem это сразу
+ * заводит страницу с правом записи.
+ */
+static inline void exchange_map_setup(void *addr, size_t size, uint32_t map_flags) {
+    if (map_flags & EXCHANGE_MAP_HUGE) madvise(addr, size, MADV_HUGEPAGE);
+    if (!(map_flags & EXCHANGE_MAP_PREFAULT)) return;
+    if (madvise(addr, size, MADV_POPULATE_WRITE) == 0) return;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    for (size_t offset = 0; offset < size; offset += page) {
+        (void)((volatile char *)addr)[offset];
+    }
+}
+
+/* Создаёт (или пересоздаёт) сегмент под заданную раскладку. */
+static inline int exchange_create(const char *name, const exchange_layout_t *layout, int flags) {
+    uint64_t busy_offset = exchange_align(sizeof(exchange_t));
+    uint64_t owners_offset = exchange_align(busy_offset + exchange_busy_words(layout->capacity) * sizeof(uint64_t));
+    uint64_t tokens_offset = exchange_align(owners_offset + (uint64_t)layout->capacity * sizeof(uint64_t));
+    uint64_t waits_offset = exchange_align(tokens_offset + (uint64_t)layout->capacity * sizeof(uint64_t));
+    uint64_t calls_offset = exchange_align(waits_offset + (uint64_t)layout->capacity * sizeof(exchange_wait_t));
+    uint64_t stats_offset = exchange_align(calls_offset + (uint64_t)layout->capacity * sizeof(exchange_call_t));
+    uint32_t stats_slots = stats_slot_count(layout->capacity);
+    uint64_t size = exchange_align(stats_offset + (uint64_t)stats_slots * sizeof(talker_stats_t));
+    uint64_t log_offset = 0;
+    uint32_t entry_size = (layout->log_entry_size + 7) & ~7u;
+    if (layout->log_capacity > 0) {
+        log_offset = size;
+        size = exchange_align(log_offset + sizeof(exchange_log_t) + (uint64_t)layout->log_capacity * entry_size);
+    }
+
+    // Сегмент живёт в tmpfs /dev/shm, который по умолчанию не больше половины памяти.
+    uint64_t memory = (uint64_t)sysconf(_SC_PHYS_PAGES) * (uint64_t)sysconf(_SC_PAGESIZE);
+    if (size > memory / 2) {
+        fprintf(stderr, "Сегмент %.1f МБ больше половины физической памяти (%.1f МБ), уменьшите ёмкость\n",
+                size / (1024.0 * 1024.0), memory / (1024.0 * 1024.0));
+        return -1;
+    }
+
+    int shm_fd = shm_open(name, O_CREAT | O_RDWR | flags, 0666);
+    if (shm_fd == -1) {
+        if (errno != EEXIST) perror("shm_open");
+        return -1;
+    }
+    if (ftruncate(shm_fd, 0) == -1 || ftruncate(shm_fd, (off_t)size) == -1) {
+        perror("ftruncate");
+        close(shm_fd);
+        return -1;
+    }
+    // Без огромных страниц сегмент размечается прямо в mmap.
+    uint32_t map_flags = layout->map_flags;
+    int populate = (map_flags & EXCHANGE_MAP_PREFAULT) && !(map_flags & EXCHANGE_MAP_HUGE) ? MAP_POPULATE : 0;
+    exchange_t *ex = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | populate, shm_fd, 0);
+    close(shm_fd);
+    if (ex == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    if (!populate) exchange_map_setup(ex, size, map_flags);
+
+    ex->version = EXCHANGE_VERSION;
+    ex->size = size;
+    ex->capacity = layout->capacity;
+    ex->header_size = sizeof(exchange_t);
+    ex->busy_offset = busy_offset;
+    ex->log_offset = log_offset;
+    ex->log_capacity = layout->log_capacity;
+    ex->log_entry_size = entry_size;
+    ex->queue_shards = layout->queue_shards;
+    ex->exchange_index = layout->exchange_index;
+    ex->exchange_count = layout->exchange_count;
+    ex->map_flags = map_flags;
+    ex->stats_slots = stats_slots;
+    ex->stats_offset = stats_offset;
+    ex->owners_offset = owners_offset;
+    ex->tokens_offset = tokens_offset;
+    ex->waits_offset = waits_offset;
+    ex->calls_offset = calls_offset;
+    for (uint32_t i = 0; i < layout->capacity; ++i) {
+        exchange_calls(ex)[i].partner = -1;
+    }
+    ex->epoch_ms = stats_now_ms();
+    // Робастный мьютекс: смерть владельца не блокирует остальных навсегда.
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&ex->id_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (log_offset) {
+        exchange_log(ex)->backpressure = layout->backpressure;
+        exchange_log(ex)->block_timeout_ms = layout->block_timeout_ms;
+    }
+    atomic_thread_fence(memory_order_release);
+    ex->magic = EXCHANGE_MAGIC;
+    munmap(ex, size);
+    return 0;
+}
+
+/* Подключается к существующему сегменту, проверяя заголовок. */
+static inline exchange_t *exchange_attach(const char *name) {
+    int shm_fd = shm_open(name, O_RDWR, 0666);
+    if (shm_fd == -1) {
+        if (errno == ENOENT) {
+            fprintf(stderr, "Сегмент %s не найден, выполните --init\n", name);
+        } else {
+            perror("shm_open");
+        }
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(shm_fd, &st) == -1 || (size_t)st.st_size < sizeof(exchange_t)) {
+        fprintf(stderr, "Сегмент %s не инициализирован, выполните --init\n", name);
+        close(shm_fd);
+        return NULL;
+    }
+    exchange_t *ex = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (ex == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    if (ex->magic != EXCHANGE_MAGIC || ex->version != EXCHANGE_VERSION || ex->size > (uint64_t)st.st_size) {
+        fprintf(stderr, "Сегмент %s имеет неизвестный формат (версия %u), выполните --init\n", name, ex->version);
+        munmap(ex, (size_t)st.st_size);
+        return NULL;
+    }
+    atomic_thread_fence(memory_order_acquire);
+    exchange_map_setup(ex, (size_t)ex->size, ex->map_flags);
+    return ex;
+}
+
+/* Опубликован ли заголовок сегмента (magic пишется последним). */
+static inline int exchange_published(const char *name) {
+    int shm_fd = shm_open(name, O_RDONLY, 0);
+    if (shm_fd == -1) return 0;
+    struct stat st;
+    int published = 0;
+    if (fstat(shm_fd, &st) == 0 && (size_t)st.st_size >= sizeof(exchange_t)) {
+        exchange_t *ex = mmap(NULL, sizeof(exchange_t), PROT_READ, MAP_SHARED, shm_fd, 0);
+        if (ex != MAP_FAILED) {
+            published = *(volatile uint32_t *)&ex->magic == EXCHANGE_MAGIC;
+            munmap(ex, sizeof(exchange_t));
+        }
+    }
+    close(shm_fd);
+    return published;
+}
+
+/*
+ * Подключение без --init: сегмент создаётся с раскладкой layout, если его
+ * ещё нет. Если его в это же время создаёт другой процесс, заголовок
+ * ждётся до EXCHANGE_OPEN_WAIT_MS, а затем сегмент проверяется как обычно.
+ */
+static inline exchange_t *exchange_open(const char *name, const exchange_layout_t *layout) {
+    if (exchange_create(name, layout, O_EXCL) == -1 && errno == EEXIST) {
+        long long deadline = stats_now_ms() + EXCHANGE_OPEN_WAIT_MS;
+        while (!exchange_published(name) && stats_now_ms() < deadline) {
+            struct timespec pause = { 0, 10000000 };
+            nanosleep(&pause, NULL);
+        }
+    }
+    return exchange_attach(name);
+}
+
+/*
+ * Захват мьютекса выдачи номеров с замером ожидания. Если прежний владелец
+ * умер, не отпустив мьютекс, захват возвращает EOWNERDEAD. Под мьютексом
+ * меняется только next_id, одно целое, поэтому состояние всегда
+ * согласовано и мьютекс сразу помечается восстановленным.
+ */
+static inline uint64_t exchange_lock(exchange_t *ex) {
+    uint64_t start = lockstat_now();
+    if (pthread_mutex_lock(&ex->id_lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&ex->id_lock);
+        atomic_fetch_add_explicit(&ex->lock_recoveries, 1, memory_order_relaxed);
+    }
+    uint64_t acquired = lockstat_now();
+    lockstat_record(&ex->locks[EXCHANGE_LOCK_DATA].wait, acquired - start);
+    return acquired;
+}
+
+static inline void exchange_unlock(exchange_t *ex, uint64_t acquired) {
+    lockstat_record(&ex->locks[EXCHANGE_LOCK_DATA].hold, lockstat_now() - acquired);
+    pthread_mutex_unlock(&ex->id_lock);
+}
+
+static inline uint32_t exchange_clock(const exchange_t *ex) {
+    return (uint32_t)(stats_now_ms() - ex->epoch_ms);
+}
+
+static inline uint64_t exchange_owner(pid_t pid, uint32_t until) {
+    return ((uint64_t)(uint32_t)pid << 32) | until;
+}
+
+/* Занимает пару и помечает оба телефона владельцем с арендой lease_ms. */
+static inline int exchange_reserve_pair(exchange_t *ex, int a, int b, pid_t pid, uint32_t lease_ms) {
+    if (!phone_bits_reserve_pair(exchange_busy(ex), a, b, &ex->rollbacks)) return 0;
+    uint64_t owner = exchange_owner(pid, exchange_clock(ex) + lease_ms);
+    atomic_store(&exchange_owners(ex)[a], owner);
+    atomic_store(&exchange_owners(ex)[b], owner);
+    return 1;
+}
+
+/*
+ * Одна сторона звонка; partner = -1 — разговор окончен. Нечётный номер
+ * версии остаётся от писателя, убитого посреди записи; писатель строки
+ * один, поэтому номер не увеличивается, а выставляется.
+ */
+static inline void exchange_call_set(exchange_t *ex, int phone, uint32_t partner_exchange, int partner, int caller) {
+    exchange_call_t *call = &exchange_calls(ex)[phone];
+    unsigned seq = atomic_load_explicit(&call->seq, memory_order_relaxed) | 1;
+    atomic_store_explicit(&call->seq, seq, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    call->partner = partner;
+    call->partner_exchange = partner_exchange;
+    call->since_ms = exchange_clock(ex);
+    call->caller = (uint32_t)caller;
+    atomic_store_explicit(&call->seq, seq + 1, memory_order_release);
+}
+
+/*
+ * Разговор a с b на одной станции. Строки пишутся по очереди: снимок может
+ * застать одну сторону уже в разговоре, а другую ещё нет, но пару печатает
+ * только строка звонившего.
+ */
+static inline void exchange_call_begin(exchange_t *ex, int a, int b) {
+    exchange_call_set(ex, b, ex->exchange_index, a, 0);
+    exchange_call_set(ex, a, ex->exchange_index, b, 1);
+}
+
+static inline void exchange_call_end(exchange_t *ex, int a, int b) {
+    exchange_call_set(ex, a, 0, -1, 0);
+    exchange_call_set(ex, b, 0, -1, 0);
+}
+
+/*
+ * Копирует таблицу в out (capacity строк), каждую строку — под её seqlock.
+ * Строку, которую за EXCHANGE_SNAPSHOT_TRIES попыток не удалось застать
+ * без писателя (или чей писатель убит посреди записи), копирует как есть.
+ * Возвращает число таких строк, 0 — снимок согласован.
+ */
+static inline unsigned long exchange_calls_snapshot(exchange_t *ex, exchange_call_t *out) {
+    unsigned long torn = 0;
+    for (uint32_t i = 0; i < ex->capacity; ++i) {
+        exchange_call_t *call = &exchange_calls(ex)[i];
+        int consistent = 0;
+        for (int attempt = 0; attempt < EXCHANGE_SNAPSHOT_TRIES && !consistent; ++attempt) {
+            if (attempt) sched_yield();
+            unsigned before = atomic_load_explicit(&call->seq, memory_order_acquire);
+            out[i].partner = call->partner;
+            out[i].partner_exchange = call->partner_exchange;
+            out[i].since_ms = call->since_ms;
+            out[i].caller = call->caller;
+            atomic_thread_fence(memory_order_acquire);
+            consistent = !(before & 1) && atomic_load_explicit(&call->seq, memory_order_relaxed) == before;
+        }
+        if (!consistent) torn++;
+    }
+    return torn;
+}
+
+/*
+ * Занимает один телефон: сторона звонка между станциями (см. gateway.h).
+ * Метка звонка пишется раньше метки владельца, поэтому тот, кто прочитал
+ * новую метку владельца, увидит и новую метку звонка.
+ */
+static inline int exchange_reserve_phone(exchange_t *ex, int phone, pid_t pid, uint64_t token, uint32_t lease_ms) {
+    if (!phone_bit_acquire(exchange_busy(ex), phone)) return 0;
+    atomic_store(&exchange_tokens(ex)[phone], token);
+    atomic_store(&exchange_owners(ex)[phone], exchange_owner(pid, exchange_clock(ex) + lease_ms));
+    return 1;
+}
+
+/*
+ * Метка владельца телефона, если он занят звонком pid с меткой token, иначе 0.
+ * Сборщик возвращает только телефоны с истёкшей арендой, а новая аренда
+ * всегда в будущем, поэтому CAS по прочитанной здесь метке не пройдёт, если
+ * телефон за это время успели вернуть и занять снова.
+ */
+static inline uint64_t exchange_call_owner(exchange_t *ex, int phone, pid_t pid, uint64_t token) {
+    uint64_t owner = atomic_load(&exchange_owners(ex)[phone]);
+    if (owner == 0 || (pid_t)(owner >> 32) != pid) return 0;
+    return atomic_load(&exchange_tokens(ex)[phone]) == token ? owner : 0;
+}
+
+/* Продлевает аренду своего звонка; 0 — телефон уже забрал сборщик. */
+static inline int exchange_renew_phone(exchange_t *ex, int phone, pid_t pid, uint64_t token, uint32_t lease_ms) {
+    uint64_t owner = exchange_call_owner(ex, phone, pid, token);
+    if (!owner) return 0;
+    return atomic_compare_exchange_strong(&exchange_owners(ex)[phone], &owner, exchange_owner(pid, exchange_clock(ex) + lease_ms));
+}
+
+/*
+ * Бит снимается, только если метка ещё наша: если сборщик уже вернул
+ * телефон по истёкшей аренде, его мог занять другой звонок. Если телефон
+ * ждут, бит не снимается вовсе: метка меняется на передаточную (pid 0 и
+ * короткая аренда) и будится один ждущий, так что линию не перехватит
+ * звонящий со стороны.
+ */
+static inline void exchange_release_owned(exchange_t *ex, int phone, uint64_t owner) {
+    _Atomic uint64_t *slot = &exchange_owners(ex)[phone];
+    exchange_wait_t *wait = &exchange_waits(ex)[phone];
+    if (atomic_load(&wait->waiters) > 0) {
+        uint64_t handoff = exchange_owner(0, exchange_clock(ex) + EXCHANGE_HANDOFF_MS);
+        if (!atomic_compare_exchange_strong(slot, &owner, handoff)) return;
+        // Последний ждущий мог уйти по тайм-ауту до появления метки: тогда
+        // метку некому забрать, и телефон освобождается как обычно.
+        if (atomic_load(&wait->waiters) == 0 && atomic_compare_exchange_strong(slot, &handoff, 0)) {
+            phone_bit_release(exchange_busy(ex), phone);
+            return;
+        }
+        atomic_fetch_add(&wait->seq, 1);
+        syscall(SYS_futex, &wait->seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+        return;
+    }
+    if (!atomic_compare_exchange_strong(slot, &owner, 0)) return;
+    phone_bit_release(exchange_busy(ex), phone);
+}
+
+static inline void exchange_release_phone(exchange_t *ex, int phone, pid_t pid) {
+    uint64_t owner = atomic_load(&exchange_owners(ex)[phone]);
+    if (owner == 0 || (pid_t)(owner >> 32) != pid) return;
+    exchange_release_owned(ex, phone, owner);
+}
+
+/*
+ * Кладёт трубку звонка с меткой token: строка таблицы очищается и телефон
+ * освобождается, только если занят именно этим звонком. 0 — телефон уже
+ * вернул сборщик.
+ */
+static inline int exchange_release_call(exchange_t *ex, int phone, pid_t pid, uint64_t token) {
+    uint64_t owner = exchange_call_owner(ex, phone, pid, token);
+    if (!owner) return 0;
+    exchange_call_set(ex, phone, 0, -1, 0);
+    exchange_release_owned(ex, phone, owner);
+    return 1;
+}
+
+static inline void exchange_release_pair(exchange_t *ex, int a, int b, pid_t pid) {
+    exchange_release_phone(ex, a, pid);
+    exchange_release_phone(ex, b, pid);
+}
+
+/* Забирает свободный телефон или линию, переданную при отбое. */
+static inline int exchange_claim_phone(exchange_t *ex, int phone, uint64_t owner) {
+    _Atomic uint64_t *slot = &exchange_owners(ex)[phone];
+    if (phone_bit_acquire(exchange_busy(ex), phone)) {
+        atomic_store(slot, owner);
+        return 1;
+    }
+    uint64_t current = atomic_load(slot);
+    return current != 0 && (current >> 32) == 0 && atomic_compare_exchange_strong(slot, &current, owner);
+}
+
+/*
+ * Ожидание вызова: звонящий занимает свой телефон, встаёт в очередь
+ * занятого target и ждёт до timeout_ms, пока линию не передадут при отбое.
+ * Тайм-аут разрывает и взаимное ожидание двух звонящих друг друга.
+ * Возвращает 1, если пара занята; время в очереди идёт в счётчики станции.
+ */
+static inline int exchange_wait_call(exchange_t *ex, int self, int target, pid_t pid, uint32_t lease_ms, int timeout_ms) {
+    if (self == target || !phone_bit_acquire(exchange_busy(ex), self)) return 0;
+    uint64_t owner = exchange_owner(pid, exchange_clock(ex) + lease_ms + (uint32_t)timeout_ms);
+    atomic_store(&exchange_owners(ex)[self], owner);
+
+    exchange_wait_t *wait = &exchange_waits(ex)[target];
+    long long start = stats_now_ns();
+    long long deadline = stats_now_ms() + timeout_ms;
+    int connected = 0;
+    atomic_fetch_add(&wait->waiters, 1);
+    for (;;) {
+        unsigned seq = atomic_load(&wait->seq);
+        if (exchange_claim_phone(ex, target, owner)) {
+            connected = 1;
+            break;
+        }
+        long long remaining = deadline - stats_now_ms();
+        if (remaining <= 0 || atomic_load(&ex->stop_flag)) break;
+        // stop_flag проверяется не реже раза в 100 мс.
+        if (remaining > 100) remaining = 100;
+        struct timespec timeout = { 0, (long)remaining * 1000000 };
+        syscall(SYS_futex, &wait->seq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+    }
+    atomic_fetch_sub(&wait->waiters, 1);
+    // Линию могли передать между последней проверкой и уходом из очереди.
+    if (!connected && exchange_claim_phone(ex, target, owner)) connected = 1;
+    if (!connected) exchange_release_phone(ex, self, pid);
+
+    atomic_fetch_add_explicit(&ex->call_waits, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ex->call_wait_ns, (unsigned long)(stats_now_ns() - start), memory_order_relaxed);
+    if (connected) atomic_fetch_add_explicit(&ex->call_handoffs, 1, memory_order_relaxed);
+    return connected;
+}
+
+/*
+ * Сборщик: обходит занятые телефоны и возвращает те, чей владелец умер или
+ * чья аренда истекла; передаточная метка (pid 0) живёт до конца аренды.
+ * Занятый бит без метки — звонок между захватом бита и записью владельца,
+ * его сборщик не трогает. Возвращает число телефонов.
+ */
+static inline unsigned long exchange_reap(exchange_t *ex) {
+    _Atomic uint64_t *busy = exchange_busy(ex);
+    _Atomic uint64_t *owners = exchange_owners(ex);
+    uint32_t now = exchange_clock(ex);
+    unsigned long reaped = 0;
+    uint64_t words = exchange_busy_words(ex->capacity);
+    for (uint64_t w = 0; w < words; ++w) {
+        uint64_t bits = atomic_load_explicit(&busy[w], memory_order_relaxed);
+        while (bits) {
+            int phone = (int)(w * 64 + (uint64_t)__builtin_ctzll(bits));
+            bits &= bits - 1;
+            uint64_t owner = atomic_load(&owners[phone]);
+            if (owner == 0) continue;
+            pid_t pid = (pid_t)(owner >> 32);
+            int expired = (int32_t)(now - (uint32_t)owner) > 0;
+            if (!expired && (pid == 0 || !(kill(pid, 0) == -1 && errno == ESRCH))) continue;
+            if (!atomic_compare_exchange_strong(&owners[phone], &owner, 0)) continue;
+            // Пока бит занят, строку телефона никто другой не пишет. Запись
+            // заодно чинит номер версии строки, если владелец убит посреди записи.
+            exchange_call_t *call = &exchange_calls(ex)[phone];
+            if (call->partner >= 0 || (atomic_load(&call->seq) & 1)) exchange_call_set(ex, phone, 0, -1, 0);
+            phone_bit_release(busy, phone);
+            reaped++;
+        }
+    }
+    if (reaped) atomic_fetch_add_explicit(&ex->reaped, reaped, memory_order_relaxed);
+    return reaped;
+}
+
+/* Запускает сборщик не чаще раза в EXCHANGE_REAP_INTERVAL_MS на всю станцию. */
+static inline unsigned long exchange_reap_due(exchange_t *ex) {
+    long long now = stats_now_ms();
+    long long due = atomic_load_explicit(&ex->reap_at_ms, memory_order_relaxed);
+    if (now < due || !atomic_compare_exchange_strong(&ex->reap_at_ms, &due, now + EXCHANGE_REAP_INTERVAL_MS)) return 0;
+    return exchange_reap(ex);
+}
+
+/* Занятость и пары собеседников для --snapshot. */
+static inline int exchange_calls_report(exchange_t *ex, FILE *out) {
+    exchange_call_t *calls = malloc((size_t)ex->capacity * sizeof(exchange_call_t));
+    if (!calls) {
+        perror("malloc");
+        return -1;
+    }
+    unsigned long torn = exchange_calls_snapshot(ex, calls);
+    uint32_t now = exchange_clock(ex);
+    unsigned long busy = 0, talking = 0, pairs = 0;
+    for (uint64_t w = 0; w < exchange_busy_words(ex->capacity); ++w) {
+        busy += (unsigned long)__builtin_popcountll(atomic_load_explicit(&exchange_busy(ex)[w], memory_order_relaxed));
+    }
+    for (uint32_t i = 0; i < ex->capacity; ++i) {
+        if (calls[i].partner >= 0) talking++;
+    }
+    fprintf(out, "Занято телефонов: %lu из %u, в разговоре %lu\n", busy, ex->capacity, talking);
+    if (torn) fprintf(out, "Несогласованных строк: %lu (их всё время меняли или писатель убит посреди записи)\n", torn);
+    for (uint32_t i = 0; i < ex->capacity; ++i) {
+        exchange_call_t *call = &calls[i];
+        if (call->partner < 0) continue;
+        int remote = call->partner_exchange != ex->exchange_index;
+        // Пару на своей станции печатает только звонивший.
+        if (!call->caller && !remote) continue;
+        double seconds = (int32_t)(now - call->since_ms) / 1000.0;
+        if (remote && call->caller) {
+            fprintf(out, "  %u -> %u:%d  %.1f c\n", i, call->partner_exchange, call->partner, seconds);
+        } else if (remote) {
+            fprintf(out, "  %u:%d -> %u  %.1f c\n", call->partner_exchange, call->partner, i, seconds);
+        } else {
+            fprintf(out, "  %u -> %d  %.1f c\n", i, call->partner, seconds);
+        }
+        pairs++;
+    }
+    fprintf(out, "Звонков: %lu\n", pairs);
+    free(calls);
+    return 0;
+}
+
+/* Сводка счётчиков болтунов для --stats. */
+static inline void exchange_stats_report(exchange_t *ex, FILE *out) {
+    stats_report(out, exchange_stats(ex, 0), ex->stats_slots, ex->capacity, atomic_load(&ex->rollbacks), 1);
+    unsigned long reaped = atomic_load(&ex->reaped);
+    unsigned long recoveries = atomic_load(&ex->lock_recoveries);
+    if (reaped || recoveries) {
+        fprintf(out, "После упавших болтунов: возвращено телефонов %lu, восстановлений мьютекса %lu\n", reaped, recoveries);
+    }
+    unsigned long waits = atomic_load(&ex->call_waits);
+    if (waits) {
+        unsigned long handoffs = atomic_load(&ex->call_handoffs);
+        fprintf(out, "Ожидание вызова: в очереди %lu раз, дождались %lu (%.1f%%), ушли по тайм-ауту %lu, среднее ожидание %.1f мс\n",
+                waits, handoffs, 100.0 * handoffs / waits, waits - handoffs, atomic_load(&ex->call_wait_ns) / 1e6 / waits);
+    }
+}
+
+/* Ожидание и удержание блокировок станции для --locks. */
+static inline void exchange_lockstat_report(exchange_t *ex, FILE *out) {
+    static const char *names[EXCHANGE_LOCKS] = { "data_lock", "print_sem" };
+    lockstat_print_header(out);
+    for (int i = 0; i < EXCHANGE_LOCKS; ++i) {
+        lockstat_print(out, names[i], &ex->locks[i]);
+    }
+}
+
+static inline void exchange_detach(exchange_t *ex) {
+    if (ex) munmap(ex, ex->size);
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef GATEWAY_H
+#define GATEWAY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * Федерация станций программы 2: у каждой станции свой сегмент и свой
+ * шлюз на Unix-сокете. Болтун звонит на чужую станцию через шлюз своей
+ * станции, тот пересылает запрос шлюзу станции абонента. Звонок проходит
+ * в две фазы: PREPARE занимает телефоны с короткой арендой (свой болтун
+ * занимает сам, чужой — шлюз абонента), COMMIT продлевает аренду на время
+ * разговора, RELEASE кладёт трубку. Шлюз абонента отвечает на PREPARE
+ * меткой звонка, и COMMIT и RELEASE действуют, только если телефон занят
+ * звонком с этой меткой. Если сторона умирает между фазами, телефон
+ * вернёт сборщик по истёкшей аренде (см. exchange_reap).
+ *
+ * Сокет SOCK_SEQPACKET сохраняет границы сообщений, поэтому одно сообщение
+ * читается одним recv.
+ */
+#define GATEWAY_SOCKET_FMT "/tmp/talker2_gw_%u.sock"
+#define GATEWAY_MAX_EXCHANGES 64
+/* Аренда между PREPARE и COMMIT. */
+#define GATEWAY_PREPARE_MS 2000
+
+enum {
+    GATEWAY_PREPARE = 1,
+    GATEWAY_COMMIT,
+    GATEWAY_RELEASE,
+    GATEWAY_OK,
+    GATEWAY_BUSY,
+    GATEWAY_ERROR,
+};
+
+typedef struct {
+    uint32_t type;
+    uint32_t exchange;        /* станция абонента */
+    int32_t phone;            /* телефон абонента; в ответ на PREPARE — занятый */
+    uint32_t caller_exchange;
+    int32_t caller_phone;
+    uint32_t lease_ms;
+    uint64_t token;           /* метка звонка из ответа на PREPARE */
+} gateway_msg_t;
+
+/* Имя сегмента или семафора станции: у станции 0 остаются прежние имена. */
+static inline void gateway_station_name(char *buf, size_t size, const char *base, uint32_t exchange) {
+    if (exchange == 0) {
+        snprintf(buf, size, "%s", base);
+    } else {
+        snprintf(buf, size, "%s_%u", base, exchange);
+    }
+}
+
+static inline void gateway_socket_path(char *buf, size_t size, uint32_t exchange) {
+    snprintf(buf, size, GATEWAY_SOCKET_FMT, exchange);
+}
+
+static inline void gateway_address(struct sockaddr_un *addr, uint32_t exchange) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    gateway_socket_path(addr->sun_path, sizeof(addr->sun_path), exchange);
+}
+
+/* Подключение к шлюзу станции; -1 — шлюз не запущен. */
+static inline int gateway_connect(uint32_t exchange) {
+    struct sockaddr_un addr;
+    gateway_address(&addr, exchange);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static inline int gateway_send(int fd, const gateway_msg_t *msg) {
+    ssize_t sent;
+    while ((sent = send(fd, msg, sizeof(*msg), MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+    }
+    return sent == (ssize_t)sizeof(*msg) ? 0 : -1;
+}
+
+/* 0 — сообщение получено, -1 — соединение закрыто или ошибка. */
+static inline int gateway_recv(int fd, gateway_msg_t *msg) {
+    ssize_t got;
+    while ((got = recv(fd, msg, sizeof(*msg), 0)) == -1 && errno == EINTR) {
+    }
+    return got == (ssize_t)sizeof(*msg) ? 0 : -1;
+}
+
+/* Запрос с ответом в том же сообщении; возвращает тип ответа. */
+static inline uint32_t gateway_request(int fd, gateway_msg_t *msg) {
+    if (gateway_send(fd, msg) == -1 || gateway_recv(fd, msg) == -1) return GATEWAY_ERROR;
+    return msg->type;
+}
+
+#endif
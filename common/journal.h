@@ -0,0 +1,155 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "event.h"
+
+/*
+ * Двоичный журнал событий на диске (программа 4). Файл начинается с
+ * заголовка, за ним подряд идут записи event_record_t. Файл отображается в
+ * память и растёт кусками по JOURNAL_CHUNK байт, место под кусок выделяется
+ * заранее. Счётчик записей в заголовке увеличивается после копирования
+ * записи, поэтому файл остаётся читаемым, даже если писатель был убит.
+ */
+#define JOURNAL_MAGIC 0x4a4b4c54u /* "TLKJ" */
+#define JOURNAL_VERSION 1
+#define JOURNAL_CHUNK (1u << 20)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint64_t count;
+    uint64_t reserved[5];
+} journal_header_t;
+
+typedef struct {
+    int fd;
+    int writable;
+    size_t mapped;
+    uint64_t count;
+    journal_header_t *header;
+} journal_t;
+
+static inline event_record_t *journal_records(journal_t *j) {
+    return (event_record_t *)((char *)j->header + j->header->header_size);
+}
+
+static inline size_t journal_used(const journal_t *j) {
+    return sizeof(journal_header_t) + (size_t)j->count * sizeof(event_record_t);
+}
+
+static inline int journal_map(journal_t *j, size_t size) {
+    int prot = j->writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *map = mmap(NULL, size, prot, MAP_SHARED, j->fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    j->header = map;
+    j->mapped = size;
+    return 0;
+}
+
+static inline int journal_grow(journal_t *j) {
+    size_t size = j->mapped + JOURNAL_CHUNK;
+    int rc = posix_fallocate(j->fd, 0, (off_t)size);
+    if (rc != 0) {
+        fprintf(stderr, "posix_fallocate: %s\n", strerror(rc));
+        return -1;
+    }
+    munmap(j->header, j->mapped);
+    return journal_map(j, size);
+}
+
+/*
+ * Открывает журнал. Для записи файл создаётся, если его нет, а новые
+ * события дописываются в конец существующего журнала.
+ */
+static inline int journal_open(journal_t *j, const char *path, int writable) {
+    memset(j, 0, sizeof(*j));
+    j->writable = writable;
+    j->fd = open(path, writable ? O_RDWR | O_CREAT : O_RDONLY, 0666);
+    if (j->fd == -1) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(j->fd, &st) == -1) {
+        perror("fstat");
+        close(j->fd);
+        return -1;
+    }
+
+    if (writable && st.st_size == 0) {
+        int rc = posix_fallocate(j->fd, 0, JOURNAL_CHUNK);
+        if (rc != 0) {
+            fprintf(stderr, "posix_fallocate: %s\n", strerror(rc));
+            close(j->fd);
+            return -1;
+        }
+        if (journal_map(j, JOURNAL_CHUNK) == -1) {
+            close(j->fd);
+            return -1;
+        }
+        j->header->version = JOURNAL_VERSION;
+        j->header->header_size = sizeof(journal_header_t);
+        j->header->record_size = sizeof(event_record_t);
+        j->header->count = 0;
+        atomic_thread_fence(memory_order_release);
+        j->header->magic = JOURNAL_MAGIC;
+        return 0;
+    }
+
+    if ((size_t)st.st_size < sizeof(journal_header_t) || journal_map(j, (size_t)st.st_size) == -1) {
+        fprintf(stderr, "Файл %s не является журналом событий\n", path);
+        close(j->fd);
+        return -1;
+    }
+    journal_header_t *h = j->header;
+    if (h->magic != JOURNAL_MAGIC || h->version != JOURNAL_VERSION ||
+        h->header_size != sizeof(journal_header_t) || h->record_size != sizeof(event_record_t)) {
+        fprintf(stderr, "Файл %s имеет неизвестный формат журнала\n", path);
+        munmap(j->header, j->mapped);
+        close(j->fd);
+        return -1;
+    }
+    // Файл мог быть обрезан: читаются только целиком поместившиеся записи.
+    uint64_t fits = (j->mapped - sizeof(journal_header_t)) / sizeof(event_record_t);
+    j->count = h->count < fits ? h->count : fits;
+    return 0;
+}
+
+static inline int journal_append(journal_t *j, const event_record_t *ev) {
+    if (journal_used(j) + sizeof(event_record_t) > j->mapped && journal_grow(j) == -1) {
+        return -1;
+    }
+    journal_records(j)[j->count] = *ev;
+    atomic_thread_fence(memory_order_release);
+    j->header->count = ++j->count;
+    return 0;
+}
+
+/* Закрывает журнал; у записываемого файла отрезается невостребованный запас. */
+static inline void journal_close(journal_t *j) {
+    if (!j->header) return;
+    size_t used = journal_used(j);
+    munmap(j->header, j->mapped);
+    j->header = NULL;
+    if (j->writable && ftruncate(j->fd, (off_t)used) == -1) {
+        perror("ftruncate");
+    }
+    close(j->fd);
+}
+
+#endif
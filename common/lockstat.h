@@ -0,0 +1,107 @@
+#ifndef LOCKSTAT_H
+#define LOCKSTAT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <semaphore.h>
+
+/*
+ * Гистограммы времени ожидания и удержания блокировок в разделяемой памяти.
+ * Корзина b хранит интервалы [2^(b-1), 2^b) нс, поэтому запись стоит двух
+ * чтений CLOCK_MONOTONIC (vDSO, без системного вызова) и нескольких
+ * relaxed-инкрементов — замеры можно не выключать.
+ */
+#define LOCKSTAT_BUCKETS 48
+
+typedef struct {
+    _Alignas(64) atomic_ulong count;
+    atomic_ulong total_ns;
+    atomic_ulong max_ns;
+    atomic_ulong buckets[LOCKSTAT_BUCKETS];
+} lockstat_hist_t;
+
+typedef struct {
+    lockstat_hist_t wait;
+    lockstat_hist_t hold;
+} lockstat_t;
+
+static inline uint64_t lockstat_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline void lockstat_record(lockstat_hist_t *h, uint64_t ns) {
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    if (bucket >= LOCKSTAT_BUCKETS) bucket = LOCKSTAT_BUCKETS - 1;
+    atomic_fetch_add_explicit(&h->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->total_ns, ns, memory_order_relaxed);
+    unsigned long max = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&h->max_ns, &max, ns, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+/* sem_wait с замером ожидания; возвращает момент захвата для lockstat_post. */
+static inline uint64_t lockstat_wait(sem_t *sem, lockstat_t *ls) {
+    uint64_t start = lockstat_now();
+    while (sem_wait(sem) == -1 && errno == EINTR) {
+    }
+    uint64_t acquired = lockstat_now();
+    if (ls) lockstat_record(&ls->wait, acquired - start);
+    return acquired;
+}
+
+static inline void lockstat_post(sem_t *sem, lockstat_t *ls, uint64_t acquired) {
+    if (ls) lockstat_record(&ls->hold, lockstat_now() - acquired);
+    sem_post(sem);
+}
+
+/* Перцентиль с линейной интерполяцией внутри корзины, в нс. */
+static inline double lockstat_percentile(lockstat_hist_t *h, double p) {
+    unsigned long counts[LOCKSTAT_BUCKETS];
+    unsigned long total = 0;
+    for (int b = 0; b < LOCKSTAT_BUCKETS; ++b) {
+        counts[b] = atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        total += counts[b];
+    }
+    if (total == 0) return 0.0;
+    double rank = p * total;
+    unsigned long seen = 0;
+    for (int b = 0; b < LOCKSTAT_BUCKETS; ++b) {
+        if (counts[b] == 0) continue;
+        if (seen + counts[b] >= rank) {
+            if (b == 0) return 0.0;
+            double low = (double)(1ull << (b - 1));
+            double high = (double)(1ull << b);
+            double max = (double)atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+            if (high > max && max >= low) high = max;
+            return low + (high - low) * (rank - seen) / counts[b];
+        }
+        seen += counts[b];
+    }
+    return (double)atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+}
+
+static inline void lockstat_print_hist(FILE *out, const char *name, const char *kind, lockstat_hist_t *h) {
+    unsigned long count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    unsigned long total = atomic_load_explicit(&h->total_ns, memory_order_relaxed);
+    fprintf(out, "%-10s %-9s %10lu %10.2f %10.2f %10.2f %10.2f %10.2f\n", name, kind, count,
+            count ? total / 1e3 / count : 0.0, lockstat_percentile(h, 0.50) / 1e3, lockstat_percentile(h, 0.99) / 1e3,
+            lockstat_percentile(h, 0.999) / 1e3, atomic_load_explicit(&h->max_ns, memory_order_relaxed) / 1e3);
+}
+
+static inline void lockstat_print_header(FILE *out) {
+    // Ширина колонок задана в байтах, поэтому заголовок выровнен вручную.
+    fputs("блокировка замер       захватов  сред.,мкс    p50,мкс    p99,мкс   p999,мкс    max,мкс\n", out);
+}
+
+static inline void lockstat_print(FILE *out, const char *name, lockstat_t *ls) {
+    lockstat_print_hist(out, name, "wait", &ls->wait);
+    lockstat_print_hist(out, name, "hold", &ls->hold);
+}
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef PRNG_H
+#define PRNG_H
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Генератор xoshiro256** со своим состоянием у каждого болтуна. Состояние
+ * выводится через splitmix64 из общего зерна (--seed) и номера болтуна,
+ * поэтому при одном зерне болтуны принимают одни и те же решения, а потоки
+ * разных болтунов не коррелируют.
+ */
+typedef struct {
+    uint64_t s[4];
+} prng_t;
+
+static inline uint64_t prng_splitmix(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static inline void prng_seed(prng_t *rng, uint64_t seed, uint64_t stream) {
+    uint64_t x = stream;
+    x = seed ^ prng_splitmix(&x);
+    for (int i = 0; i < 4; ++i) {
+        rng->s[i] = prng_splitmix(&x);
+    }
+}
+
+static inline uint64_t prng_rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t prng_next(prng_t *rng) {
+    uint64_t *s = rng->s;
+    uint64_t result = prng_rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = prng_rotl(s[3], 45);
+    return result;
+}
+
+/* Число в [0, n) умножением со сдвигом, без деления (смещение порядка n/2^32). */
+static inline uint32_t prng_below(prng_t *rng, uint32_t n) {
+    return (uint32_t)(((prng_next(rng) >> 32) * (uint64_t)n) >> 32);
+}
+
+static inline int prng_between(prng_t *rng, int min, int max) {
+    if (max <= min) return min;
+    return min + (int)prng_below(rng, (uint32_t)(max - min + 1));
+}
+
+/* Зерно по умолчанию, если --seed не задан: время и pid. */
+static inline uint64_t prng_default_seed(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t x = ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec ^ ((uint64_t)getpid() << 16);
+    return prng_splitmix(&x);
+}
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef RESERVE_H
+#define RESERVE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Занятость телефонов без общего семафора хранится упакованной битовой
+ * картой. Бит захватывается через fetch_or, и захват успешен, только если
+ * до этого бит был сброшен. Пара занимается в фиксированном порядке
+ * (меньший номер первым); если второй телефон уже занят, первый
+ * освобождается (откат).
+ */
+static inline int phone_bit_acquire(_Atomic uint64_t *bits, int phone) {
+    uint64_t mask = (uint64_t)1 << (phone & 63);
+    return (atomic_fetch_or(&bits[phone >> 6], mask) & mask) == 0;
+}
+
+static inline void phone_bit_release(_Atomic uint64_t *bits, int phone) {
+    uint64_t mask = (uint64_t)1 << (phone & 63);
+    atomic_fetch_and_explicit(&bits[phone >> 6], ~mask, memory_order_release);
+}
+
+static inline int phone_bits_reserve_pair(_Atomic uint64_t *bits, int a, int b, atomic_ulong *rollbacks) {
+    int first = a < b ? a : b;
+    int second = a < b ? b : a;
+
+    if (a == b) return 0;
+    if (!phone_bit_acquire(bits, first)) return 0;
+    if (!phone_bit_acquire(bits, second)) {
+        phone_bit_release(bits, first);
+        atomic_fetch_add_explicit(rollbacks, 1, memory_order_relaxed);
+        return 0;
+    }
+    return 1;
+}
+
+static inline void phone_bits_release_pair(_Atomic uint64_t *bits, int a, int b) {
+    phone_bit_release(bits, a);
+    phone_bit_release(bits, b);
+}
+
+/*
+ * Свободные биты слова w (без хвоста за capacity и без self).
+ */
+static inline uint64_t phone_bits_free_word(_Atomic uint64_t *bits, int capacity, int self, int w) {
+    int words = (capacity + 63) / 64;
+    uint64_t free_mask = ~atomic_load_explicit(&bits[w], memory_order_relaxed);
+    if (w == words - 1 && (capacity & 63)) free_mask &= ((uint64_t)1 << (capacity & 63)) - 1;
+    if (w == self >> 6) free_mask &= ~((uint64_t)1 << (self & 63));
+    return free_mask;
+}
+
+/*
+ * Та же карта служит индексом свободных телефонов. Выбор равномерный:
+ * первый проход считает свободные биты (popcount по словам), из них
+ * берётся случайный номер по порядку, второй проход находит его слово и
+ * бит. Стоимость — два прохода по capacity/64 словам, а не O(1). Если
+ * карта между проходами заполнилась, берётся последний найденный свободный
+ * телефон. Возвращает -1, если свободных телефонов, кроме self, нет.
+ */
+static inline int phone_bits_pick_free(_Atomic uint64_t *bits, int capacity, int self, unsigned long random) {
+    int words = (capacity + 63) / 64;
+    unsigned long total = 0;
+    for (int w = 0; w < words; ++w) {
+        total += (unsigned long)__builtin_popcountll(phone_bits_free_word(bits, capacity, self, w));
+    }
+    if (total == 0) return -1;
+
+    unsigned long rank = random % total;
+    int last = -1;
+    for (int w = 0; w < words; ++w) {
+        uint64_t free_mask = phone_bits_free_word(bits, capacity, self, w);
+        unsigned long count = (unsigned long)__builtin_popcountll(free_mask);
+        if (count == 0) continue;
+        if (rank >= count) {
+            rank -= count;
+            last = w * 64 + 63 - __builtin_clzll(free_mask);
+            continue;
+        }
+        while (rank--) free_mask &= free_mask - 1;
+        return w * 64 + __builtin_ctzll(free_mask);
+    }
+    return last;
+}
+
+#endif
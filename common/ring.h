@@ -0,0 +1,266 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/syscall.h>
+
+#include "exchange.h"
+
+/*
+ * Кольцо событий без блокировок. Производитель получает номер (ticket)
+ * атомарным инкрементом head и публикует слот по протоколу seqlock:
+ * нечётная версия 2*ticket+1 — идёт запись, чётная 2*ticket+2 — готово.
+ * Читатель копирует слот и сверяет версию до и после копирования.
+ */
+enum { RING_READ_OK, RING_READ_PENDING, RING_READ_OVERWRITTEN, RING_READ_FILTERED };
+
+/*
+ * RING_DROP — производитель всегда пишет, отстающий наблюдатель теряет
+ * события. RING_BLOCK — производитель ждёт самого медленного наблюдателя,
+ * но не дольше block_timeout_ms, после чего всё равно перезаписывает слот.
+ */
+enum { RING_DROP, RING_BLOCK };
+
+/*
+ * Сколько производитель ждёт предыдущего писателя слота. Запись слота
+ * занимает наносекунды, поэтому нечётная версия дольше этого срока значит,
+ * что писатель убит посреди записи, и слот забирается без него.
+ */
+#define RING_STUCK_MS 100
+
+/*
+ * Пробуждение читателей: слово wake служит futex-ом в общей памяти.
+ * Производитель делает системный вызов, только если кто-то ждёт.
+ */
+static inline void ring_wake_all(exchange_t *ex) {
+    exchange_log_t *log = exchange_log(ex);
+    if (!log) return;
+    atomic_fetch_add(&log->wake, 1);
+    syscall(SYS_futex, &log->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static inline void ring_notify(exchange_t *ex) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&exchange_log(ex)->waiters, memory_order_relaxed) == 0) return;
+    ring_wake_all(ex);
+}
+
+static inline long long ring_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Наблюдатель убит, не отменив регистрацию. */
+static inline int ring_observer_dead(int pid) {
+    return pid > 0 && kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+/* Наблюдатель, ещё не прочитавший событие ticket - capacity, или -1. */
+static inline int ring_lagging_observer(exchange_t *ex, unsigned long ticket) {
+    exchange_log_t *log = exchange_log(ex);
+    unsigned limit = atomic_load_explicit(&log->observer_limit, memory_order_acquire);
+    unsigned long needed = ticket - ex->log_capacity + 1;
+
+    for (unsigned i = 0; i < limit && i < LOG_MAX_OBSERVERS; ++i) {
+        exchange_observer_t *obs = &log->observers[i];
+        if (atomic_load_explicit(&obs->pid, memory_order_acquire) <= 0) continue;
+        if (atomic_load_explicit(&obs->cursor, memory_order_acquire) < needed) return (int)i;
+    }
+    return -1;
+}
+
+static inline void ring_wait_space(exchange_t *ex, unsigned long ticket) {
+    exchange_log_t *log = exchange_log(ex);
+    if (ticket < ex->log_capacity) return;
+    long long deadline = ring_now_ms() + log->block_timeout_ms;
+
+    for (;;) {
+        int lagging = ring_lagging_observer(ex, ticket);
+        if (lagging < 0 || atomic_load(&ex->stop_flag)) return;
+
+        // Наблюдатель, убитый без отмены регистрации, не должен тормозить станцию.
+        exchange_observer_t *obs = &log->observers[lagging];
+        int pid = atomic_load(&obs->pid);
+        if (ring_observer_dead(pid)) {
+            atomic_compare_exchange_strong(&obs->pid, &pid, 0);
+            continue;
+        }
+
+        long long remaining = deadline - ring_now_ms();
+        if (remaining <= 0) return;
+        struct timespec timeout = { remaining / 1000, (long)(remaining % 1000) * 1000000 };
+        atomic_fetch_add(&log->space_waiters, 1);
+        unsigned space = atomic_load(&log->space);
+        if (ring_lagging_observer(ex, ticket) >= 0) {
+            syscall(SYS_futex, &log->space, FUTEX_WAIT, space, &timeout, NULL, 0);
+        }
+        atomic_fetch_sub(&log->space_waiters, 1);
+    }
+}
+
+static inline void ring_space_notify(exchange_t *ex) {
+    exchange_log_t *log = exchange_log(ex);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&log->space_waiters, memory_order_relaxed) == 0) return;
+    atomic_fetch_add(&log->space, 1);
+    syscall(SYS_futex, &log->space, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* key и kind попадают в заголовок слота для фильтров наблюдателей. */
+static inline unsigned long ring_append(exchange_t *ex, const void *data, size_t len, uint32_t key, uint32_t kind) {
+    exchange_log_t *log = exchange_log(ex);
+    unsigned long ticket = atomic_fetch_add_explicit(&log->head, 1, memory_order_relaxed);
+    if (log->backpressure == RING_BLOCK) ring_wait_space(ex, ticket);
+    exchange_log_slot_t *slot = exchange_log_slot(ex, ticket);
+    unsigned long writing = 2 * ticket + 1;
+    unsigned long current = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+    // Слот может ещё дописывать производитель предыдущего круга; ждём его
+    // только если он уже начал запись, а более новый номер не трогаем.
+    // Ожидание ограничено RING_STUCK_MS, после него слот забирается.
+    long long deadline = 0;
+    for (unsigned spins = 0;; ++spins) {
+        if (current >= writing) return ticket;
+        if ((current & 1) && (spins & 1023) == 1023) {
+            sched_yield();
+            if (!deadline) deadline = ring_now_ms() + RING_STUCK_MS;
+        }
+        if ((current & 1) && !(deadline && ring_now_ms() >= deadline)) {
+            current = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&slot->seq, &current, writing,
+                                                  memory_order_acquire, memory_order_relaxed)) {
+            break;
+        }
+    }
+    atomic_thread_fence(memory_order_release);
+
+    size_t payload = exchange_log_payload(ex);
+    if (len > payload) len = payload;
+    slot->key = key;
+    slot->kind = kind;
+    memcpy(slot->data, data, len);
+    atomic_store_explicit(&slot->seq, writing + 1, memory_order_release);
+    ring_notify(ex);
+    return ticket;
+}
+
+static inline int ring_read(exchange_t *ex, unsigned long ticket, void *out, size_t size) {
+    exchange_log_slot_t *slot = exchange_log_slot(ex, ticket);
+    unsigned long ready = 2 * ticket + 2;
+    unsigned long before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+    if (before < ready) return RING_READ_PENDING;
+    if (before > ready) return RING_READ_OVERWRITTEN;
+    size_t payload = exchange_log_payload(ex);
+    memcpy(out, slot->data, size < payload ? size : payload);
+    atomic_thread_fence(memory_order_acquire);
+    unsigned long after = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    return after == before ? RING_READ_OK : RING_READ_OVERWRITTEN;
+}
+
+static inline int ring_filter_match(const exchange_filter_t *filter, uint32_t key, uint32_t kind) {
+    if (filter->kinds && (kind >= 32 || !(filter->kinds & (1u << kind)))) return 0;
+    if (key < filter->key_min || key > filter->key_max) return 0;
+    return !filter->keys || (key < 64 && (filter->keys >> key & 1));
+}
+
+/*
+ * Как ring_read, но сначала сверяет с фильтром ключ и вид из заголовка
+ * слота: отсеянная запись не копируется (RING_READ_FILTERED).
+ */
+static inline int ring_read_filtered(exchange_t *ex, unsigned long ticket, const exchange_filter_t *filter,
+                                     void *out, size_t size) {
+    exchange_log_slot_t *slot = exchange_log_slot(ex, ticket);
+    unsigned long ready = 2 * ticket + 2;
+    unsigned long before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+    if (before < ready) return RING_READ_PENDING;
+    if (before > ready) return RING_READ_OVERWRITTEN;
+    int match = ring_filter_match(filter, slot->key, slot->kind);
+    if (match) {
+        size_t payload = exchange_log_payload(ex);
+        memcpy(out, slot->data, size < payload ? size : payload);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    unsigned long after = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    if (after != before) return RING_READ_OVERWRITTEN;
+    return match ? RING_READ_OK : RING_READ_FILTERED;
+}
+
+static inline unsigned long ring_head(exchange_t *ex) {
+    return atomic_load_explicit(&exchange_log(ex)->head, memory_order_acquire);
+}
+
+/*
+ * Регистрация наблюдателя в общей таблице. Курсор и фильтр выставляются до
+ * того, как слот получает pid, поэтому производители не видят чужой курсор.
+ * Слот убитого наблюдателя забирается так же, как свободный: иначе в режиме
+ * drop его никто не вернёт до --init. filter = NULL — наблюдатель получает
+ * все записи.
+ */
+static inline int ring_observer_register(exchange_t *ex, unsigned long cursor, const exchange_filter_t *filter) {
+    exchange_log_t *log = exchange_log(ex);
+    for (int i = 0; i < LOG_MAX_OBSERVERS; ++i) {
+        exchange_observer_t *obs = &log->observers[i];
+        int expected = atomic_load(&obs->pid);
+        if (expected != 0 && !ring_observer_dead(expected)) continue;
+        if (!atomic_compare_exchange_strong(&obs->pid, &expected, -1)) continue;
+        atomic_store(&obs->cursor, cursor);
+        atomic_store(&obs->skipped, 0);
+        atomic_store(&obs->matched, 0);
+        atomic_store(&obs->filtered, 0);
+        if (filter) {
+            obs->filter = *filter;
+        } else {
+            obs->filter = (exchange_filter_t){ .key_max = UINT32_MAX };
+        }
+        atomic_store(&obs->pid, (int)getpid());
+
+        unsigned limit = atomic_load(&log->observer_limit);
+        while (limit < (unsigned)i + 1 && !atomic_compare_exchange_weak(&log->observer_limit, &limit, (unsigned)i + 1)) {
+        }
+        return i;
+    }
+    return -1;
+}
+
+static inline void ring_observer_unregister(exchange_t *ex, int index) {
+    atomic_store(&exchange_log(ex)->observers[index].pid, 0);
+    ring_space_notify(ex);
+}
+
+static inline void ring_observer_advance(exchange_t *ex, int index, unsigned long cursor) {
+    atomic_store_explicit(&exchange_log(ex)->observers[index].cursor, cursor, memory_order_release);
+    ring_space_notify(ex);
+}
+
+/*
+ * Блокирует читателя, пока слот ticket не будет опубликован, не будет
+ * запрошена остановка или не истечёт timeout_ms (-1 — без ограничения).
+ * Сигнал прерывает ожидание, если обработчик установлен без SA_RESTART.
+ */
+static inline void ring_wait(exchange_t *ex, unsigned long ticket, int timeout_ms) {
+    exchange_log_t *log = exchange_log(ex);
+    exchange_log_slot_t *slot = exchange_log_slot(ex, ticket);
+    struct timespec timeout = { timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000 };
+
+    atomic_fetch_add(&log->waiters, 1);
+    unsigned wake = atomic_load(&log->wake);
+    if (atomic_load(&slot->seq) < 2 * ticket + 2 && !atomic_load(&ex->stop_flag)) {
+        syscall(SYS_futex, &log->wake, FUTEX_WAIT, wake, timeout_ms < 0 ? NULL : &timeout, NULL, 0);
+    }
+    atomic_fetch_sub(&log->waiters, 1);
+}
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Счётчики болтуна в разделяемой памяти. Каждый слот занимает ровно одну
+ * кэш-линию, поэтому болтуны не мешают друг другу (нет ложного разделения).
+ * Счётчики меняются relaxed-операциями, а отчёт читает их без
+ * синхронизации и допускает расхождение в единицы. Слотов не больше
+ * STATS_MAX_SLOTS: при большем числе болтунов слот делят болтуны с
+ * номерами i, i + STATS_MAX_SLOTS, ..., счётчики в нём суммируются, а pid и
+ * время выхода остаются от последнего писавшего.
+ */
+#define STATS_ALIGN 64
+#define STATS_MAX_SLOTS 65536
+
+typedef struct {
+    _Alignas(STATS_ALIGN) atomic_int pid; /* 0 — болтун сейчас не работает */
+    atomic_ulong attempts;
+    atomic_ulong calls;
+    atomic_ulong busy;      /* отказы: абонент занят */
+    atomic_ulong talk_ms;
+    atomic_ulong wait_ns;   /* ожидание на семафорах и места в кольце */
+    atomic_llong start_ms;  /* первый запуск, CLOCK_MONOTONIC */
+    atomic_llong end_ms;    /* 0, пока болтун работает */
+} talker_stats_t;
+
+_Static_assert(sizeof(talker_stats_t) == STATS_ALIGN, "слот статистики должен занимать одну кэш-линию");
+
+/* Болтуны с номерами больше STATS_MAX_SLOTS делят слоты по модулю. */
+static inline uint32_t stats_slot_count(uint32_t talkers) {
+    return talkers < STATS_MAX_SLOTS ? talkers : STATS_MAX_SLOTS;
+}
+
+static inline long long stats_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline long long stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void stats_add(atomic_ulong *counter, unsigned long value) {
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+static inline void stats_begin(talker_stats_t *st) {
+    long long expected = 0;
+    atomic_compare_exchange_strong(&st->start_ms, &expected, stats_now_ms());
+    atomic_store_explicit(&st->end_ms, 0, memory_order_relaxed);
+    atomic_store_explicit(&st->pid, (int)getpid(), memory_order_relaxed);
+}
+
+static inline void stats_end(talker_stats_t *st) {
+    atomic_store_explicit(&st->end_ms, stats_now_ms(), memory_order_relaxed);
+    atomic_store_explicit(&st->pid, 0, memory_order_relaxed);
+}
+
+/*
+ * Печатает строки по каждому болтуну (если per_talker) и итог по станции.
+ * Скорости считаются по времени от первого запуска до выхода или до сейчас.
+ * talkers — число болтунов; если их больше count, слоты общие по модулю.
+ */
+static inline void stats_report(FILE *out, talker_stats_t *slots, uint32_t count, uint32_t talkers,
+                                unsigned long rollbacks, int per_talker) {
+    long long now = stats_now_ms();
+    long long first = 0, last = 0;
+    unsigned long attempts = 0, calls = 0, busy = 0, talk_ms = 0, wait_ns = 0;
+    unsigned active = 0, seen = 0;
+
+    if (per_talker) {
+        // Ширина колонок задана в байтах, поэтому заголовок выровнен вручную.
+        fputs("болтун      pid   попыток   звонков    занято занято%  разговор,с ожидание,мс звонков/мин\n", out);
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        talker_stats_t *st = &slots[i];
+        long long start = atomic_load_explicit(&st->start_ms, memory_order_relaxed);
+        if (!start) continue;
+        int pid = atomic_load_explicit(&st->pid, memory_order_relaxed);
+        long long end = pid ? now : atomic_load_explicit(&st->end_ms, memory_order_relaxed);
+        if (end < start) end = now;
+        unsigned long a = atomic_load_explicit(&st->attempts, memory_order_relaxed);
+        unsigned long c = atomic_load_explicit(&st->calls, memory_order_relaxed);
+        unsigned long b = atomic_load_explicit(&st->busy, memory_order_relaxed);
+        unsigned long t = atomic_load_explicit(&st->talk_ms, memory_order_relaxed);
+        unsigned long w = atomic_load_explicit(&st->wait_ns, memory_order_relaxed);
+        double minutes = (end - start) / 60000.0;
+
+        if (per_talker) {
+            fprintf(out, "%6u %8d %9lu %9lu %9lu %7.1f %11.1f %11.3f %11.1f\n",
+                    i, pid, a, c, b, a ? 100.0 * b / a : 0.0, t / 1000.0, w / 1e6, minutes > 0 ? c / minutes : 0.0);
+        }
+        if (!seen || start < first) first = start;
+        if (end > last) last = end;
+        attempts += a;
+        calls += c;
+        busy += b;
+        talk_ms += t;
+        wait_ns += w;
+        active += pid != 0;
+        seen++;
+    }
+
+    double seconds = seen ? (last - first) / 1000.0 : 0.0;
+    if (talkers > count) {
+        fprintf(out, "Болтунов %u, слотов статистики %u: слоты общие по модулю %u, pid и время выхода в них "
+                     "от последнего писавшего болтуна\n", talkers, count, count);
+    }
+    // При общих слотах считаются слоты, а не болтуны.
+    fprintf(out, "Станция: %s %u (активно %u), попыток %lu, звонков %lu, занято %lu (%.1f%%), откатов %lu\n",
+            talkers > count ? "слотов" : "болтунов", seen, active, attempts, calls, busy, attempts ? 100.0 * busy / attempts : 0.0, rollbacks);
+    fprintf(out, "За %.1f c: %.2f звонков/c, %.2f попыток/c, средний разговор %.2f c, ожидание на попытку %.3f мс\n",
+            seconds, seconds > 0 ? calls / seconds : 0.0, seconds > 0 ? attempts / seconds : 0.0,
+            calls ? talk_ms / 1000.0 / calls : 0.0, attempts ? wait_ns / 1e6 / attempts : 0.0);
+}
+
+#endif
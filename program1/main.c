@@ -11,107 +11,547 @@
 #include <string.h>
 #include <stdarg.h>
 #include <sys/wait.h>
+#include <pthread.h>
+
+#include "async_log.h"
+#include "lockstat.h"
+#include "prng.h"
+#include "reserve.h"
+#include "stats.h"
 
 #define MAX_BOLTUNS 32
 
+#define MAX_POOL_BOLTUNS 1000000
+#define WHEEL_SLOTS 1024
+#define WHEEL_TICK_MS 10
+
+/*
+ * Поля разнесены по кэш-линиям: параметры только читаются, stop_flag
+ * опрашивается на каждом шаге, счётчики и семафор печати пишутся, а
+ * битовая карта занятости меняется при каждом звонке.
+ */
 typedef struct {
     int num_boltuns;
-    int busy[MAX_BOLTUNS];
-    int stop_flag;
-    sem_t data_lock;
-    sem_t print_lock;
+    uint32_t stats_slots;
+    size_t stats_offset;
+    _Alignas(STATS_ALIGN) atomic_int stop_flag;
+    _Alignas(STATS_ALIGN) atomic_ulong rollbacks;
+    atomic_ulong attempts;
+    atomic_ulong wasted;
+    _Alignas(STATS_ALIGN) sem_t print_lock;
+    lockstat_t print_stat;
+    _Alignas(STATS_ALIGN) _Atomic uint64_t busy[];
 } shared_data_t;
 
+enum { PICK_RANDOM, PICK_FREE };
+
 static volatile sig_atomic_t terminate_requested = 0;
+static int pick_policy = PICK_RANDOM;
+static uint64_t base_seed;
 
 static void handle_sigint(int signo) {
     (void)signo;
     terminate_requested = 1;
 }
 
-static int random_between(int min, int max) {
-    if (max <= min) return min;
-    return min + rand() % (max - min + 1);
+static int random_between(prng_t *rng, int min, int max) {
+    return prng_between(rng, min, max);
+}
+
+// За битовой картой занятости с границы кэш-линии идут слоты статистики.
+static size_t shared_stats_offset(int boltuns) {
+    size_t end = sizeof(shared_data_t) + ((size_t)boltuns + 63) / 64 * sizeof(uint64_t);
+    return (end + STATS_ALIGN - 1) & ~(size_t)(STATS_ALIGN - 1);
+}
+
+static size_t shared_size(int boltuns) {
+    return shared_stats_offset(boltuns) + stats_slot_count((uint32_t)boltuns) * sizeof(talker_stats_t);
+}
+
+static talker_stats_t *shared_stats(shared_data_t *shared, int id) {
+    return (talker_stats_t *)((char *)shared + shared->stats_offset) + (uint32_t)id % shared->stats_slots;
 }
 
-static void log_message(shared_data_t *shared, const char *fmt, ...) {
+// Строка уходит в буфер процесса, print_lock берёт только поток вывода.
+static void log_message(const char *fmt, ...) {
     va_list args;
-    sem_wait(&shared->print_lock);
     va_start(args, fmt);
-    vprintf(fmt, args);
+    async_log_vprintf(fmt, args);
     va_end(args);
-    fflush(stdout);
-    sem_post(&shared->print_lock);
+}
+
+static int pick_target(shared_data_t *shared, prng_t *rng, int id) {
+    int num_boltuns = shared->num_boltuns;
+    if (pick_policy == PICK_FREE) {
+        return phone_bits_pick_free(shared->busy, num_boltuns, id, (unsigned long)prng_next(rng));
+    }
+    int target = id;
+    int tries = 0;
+    while (target == id && tries < 3 * num_boltuns) {
+        target = (int)prng_below(rng, (uint32_t)num_boltuns);
+        tries++;
+    }
+    return target;
+}
+
+// Попытка занять оба телефона; возвращает 0 при успехе, -1 если линия занята, 1 при остановке.
+static int try_reserve(shared_data_t *shared, int id, int target) {
+    if (shared->stop_flag) return 1;
+    if (target < 0 || !phone_bits_reserve_pair(shared->busy, id, target, &shared->rollbacks)) return -1;
+    if (shared->stop_flag) {
+        phone_bits_release_pair(shared->busy, id, target);
+        return 1;
+    }
+    return 0;
+}
+
+static void release_pair(shared_data_t *shared, int id, int target) {
+    phone_bits_release_pair(shared->busy, id, target);
+}
+
+static void report_attempts(shared_data_t *shared, unsigned long long calls, unsigned long long wasted) {
+    atomic_fetch_add_explicit(&shared->attempts, calls + wasted, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shared->wasted, wasted, memory_order_relaxed);
 }
 
 static void run_boltun(int id, shared_data_t *shared, int min_pause, int max_pause, int min_talk, int max_talk) {
-    srand((unsigned)time(NULL) ^ (getpid()<<16));
+    prng_t rng;
+    prng_seed(&rng, base_seed, (uint64_t)id);
+    unsigned long long calls = 0, wasted = 0;
+    talker_stats_t *stats = shared_stats(shared, id);
+    stats_begin(stats);
     while (!terminate_requested && !shared->stop_flag) {
-        int sleep_time = random_between(min_pause, max_pause);
+        int sleep_time = random_between(&rng, min_pause, max_pause);
         sleep(sleep_time);
 
         if (terminate_requested || shared->stop_flag) break;
 
-        int target = id;
-        int tries = 0;
-        while (target == id && tries < 3 * shared->num_boltuns) {
-            target = rand() % shared->num_boltuns;
-            tries++;
+        int target = pick_target(shared, &rng, id);
+        int rc = try_reserve(shared, id, target);
+        if (rc > 0) break;
+        stats_add(&stats->attempts, 1);
+        if (rc < 0) {
+            wasted++;
+            stats_add(&stats->busy, 1);
+            continue; // попробовать позже
         }
+        calls++;
+
+        log_message("[%d] звоню абоненту %d (ожидал %d c)\n", id, target, sleep_time);
+        int talk_time = random_between(&rng, min_talk, max_talk);
+        sleep(talk_time);
 
-        sem_wait(&shared->data_lock);
-        if (shared->stop_flag) {
-            sem_post(&shared->data_lock);
-            break;
+        release_pair(shared, id, target);
+        stats_add(&stats->calls, 1);
+        stats_add(&stats->talk_ms, (unsigned long)talk_time * 1000);
+
+        log_message("[%d] завершил разговор с %d за %d c\n", id, target, talk_time);
+    }
+
+    report_attempts(shared, calls, wasted);
+    stats_end(stats);
+    log_message("[%d] завершает работу\n", id);
+}
+
+/*
+ * Режим виртуального времени: те же болтуны, но вместо sleep() события
+ * упорядочиваются в очереди с приоритетом по модельному времени (в мс).
+ */
+enum { VT_WAKE, VT_HANGUP };
+
+typedef struct {
+    long long time_ms;
+    unsigned long order;
+    int id;
+    int kind;
+    int target;
+    int duration;
+} vt_event_t;
+
+typedef struct {
+    vt_event_t *items;
+    size_t size;
+    size_t cap;
+    unsigned long next_order;
+} vt_queue_t;
+
+static int vt_before(const vt_event_t *a, const vt_event_t *b) {
+    if (a->time_ms != b->time_ms) return a->time_ms < b->time_ms;
+    return a->order < b->order;
+}
+
+static void vt_push(vt_queue_t *q, vt_event_t ev) {
+    if (q->size == q->cap) {
+        size_t cap = q->cap ? q->cap * 2 : 64;
+        vt_event_t *items = realloc(q->items, cap * sizeof(vt_event_t));
+        if (!items) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
         }
+        q->items = items;
+        q->cap = cap;
+    }
+    ev.order = q->next_order++;
+    size_t i = q->size++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!vt_before(&ev, &q->items[parent])) break;
+        q->items[i] = q->items[parent];
+        i = parent;
+    }
+    q->items[i] = ev;
+}
 
-        if (target == id || shared->busy[target] || shared->busy[id]) {
-            sem_post(&shared->data_lock);
-            continue; // попробовать позже
+static vt_event_t vt_pop(vt_queue_t *q) {
+    vt_event_t top = q->items[0];
+    vt_event_t last = q->items[--q->size];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= q->size) break;
+        if (child + 1 < q->size && vt_before(&q->items[child + 1], &q->items[child])) child++;
+        if (!vt_before(&q->items[child], &last)) break;
+        q->items[i] = q->items[child];
+        i = child;
+    }
+    if (q->size > 0) q->items[i] = last;
+    return top;
+}
+
+// Нулевые паузы заменяются на 1 мс, иначе модельное время не продвигается.
+static long long vt_delay_ms(int seconds) {
+    return seconds > 0 ? (long long)seconds * 1000 : 1;
+}
+
+static void vt_schedule_wake(vt_queue_t *q, prng_t *rng, long long now, int id, int min_pause, int max_pause) {
+    vt_event_t ev = {0};
+    ev.duration = random_between(rng, min_pause, max_pause);
+    ev.time_ms = now + vt_delay_ms(ev.duration);
+    ev.id = id;
+    ev.kind = VT_WAKE;
+    vt_push(q, ev);
+}
+
+static void run_virtual(shared_data_t *shared, int simulation_time, int min_pause, int max_pause, int min_talk, int max_talk) {
+    vt_queue_t queue = {0};
+    long long end_ms = (long long)simulation_time * 1000;
+    unsigned long long events = 0, calls = 0, rejected = 0;
+    struct timespec wall_start, wall_end;
+
+    prng_t *rngs = calloc((size_t)shared->num_boltuns, sizeof(prng_t));
+    if (!rngs) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+    for (int id = 0; id < shared->num_boltuns; ++id) {
+        prng_seed(&rngs[id], base_seed, (uint64_t)id);
+        vt_schedule_wake(&queue, &rngs[id], 0, id, min_pause, max_pause);
+    }
+
+    while (queue.size > 0 && queue.items[0].time_ms <= end_ms) {
+        if ((events & 4095) == 0 && terminate_requested) break;
+        vt_event_t ev = vt_pop(&queue);
+        long long now = ev.time_ms;
+        events++;
+
+        if (ev.kind == VT_WAKE) {
+            int target = pick_target(shared, &rngs[ev.id], ev.id);
+            if (try_reserve(shared, ev.id, target) != 0) {
+                rejected++;
+                vt_schedule_wake(&queue, &rngs[ev.id], now, ev.id, min_pause, max_pause);
+                continue;
+            }
+            calls++;
+            printf("[t=%lld.%03lld] [%d] звоню абоненту %d (ожидал %d c)\n",
+                   now / 1000, now % 1000, ev.id, target, ev.duration);
+            vt_event_t hangup = {0};
+            hangup.duration = random_between(&rngs[ev.id], min_talk, max_talk);
+            hangup.time_ms = now + vt_delay_ms(hangup.duration);
+            hangup.id = ev.id;
+            hangup.kind = VT_HANGUP;
+            hangup.target = target;
+            vt_push(&queue, hangup);
+        } else {
+            release_pair(shared, ev.id, ev.target);
+            printf("[t=%lld.%03lld] [%d] завершил разговор с %d за %d c\n",
+                   now / 1000, now % 1000, ev.id, ev.target, ev.duration);
+            vt_schedule_wake(&queue, &rngs[ev.id], now, ev.id, min_pause, max_pause);
         }
+    }
 
-        shared->busy[target] = 1;
-        shared->busy[id] = 1;
-        sem_post(&shared->data_lock);
+    long long final_ms = terminate_requested && queue.size > 0 ? queue.items[0].time_ms : end_ms;
+    for (int id = 0; id < shared->num_boltuns; ++id) {
+        printf("[t=%lld.%03lld] [%d] завершает работу\n", final_ms / 1000, final_ms % 1000, id);
+    }
 
-        log_message(shared, "[%d] звоню абоненту %d (ожидал %d c)\n", id, target, sleep_time);
-        int talk_time = random_between(min_talk, max_talk);
-        sleep(talk_time);
+    report_attempts(shared, calls, rejected);
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    double wall = (wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9;
+    fflush(stdout);
+    fprintf(stderr, "Виртуальное время: событий %llu, звонков %llu, отказов %llu (откатов %lu) за %.3f c (%.0f звонков/c)\n",
+            events, calls, rejected, atomic_load(&shared->rollbacks), wall, wall > 0 ? calls / wall : 0.0);
+    free(queue.items);
+    free(rngs);
+}
+
+/*
+ * Режим пула потоков: болтуны — лёгкие конечные автоматы, а не процессы.
+ * Каждый рабочий поток обслуживает свою долю болтунов (id % workers) и
+ * будит их по собственному колесу таймеров с шагом WHEEL_TICK_MS.
+ */
+enum { POOL_WAIT, POOL_TALK };
+
+typedef struct {
+    long long due_tick;
+    int next;
+    int phase;
+    int target;
+    int duration;
+    prng_t rng;
+} pool_boltun_t;
+
+typedef struct {
+    pthread_t thread;
+    int index;
+    int workers;
+    int count;
+    pool_boltun_t *boltuns;
+    int wheel[WHEEL_SLOTS];
+    long long start_ms;
+    int min_pause, max_pause, min_talk, max_talk;
+    shared_data_t *shared;
+    unsigned long long calls;
+    unsigned long long rejected;
+} pool_worker_t;
+
+static long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void wheel_insert(pool_worker_t *w, int local, long long now_tick, int seconds) {
+    pool_boltun_t *b = &w->boltuns[local];
+    long long ticks = (long long)seconds * 1000 / WHEEL_TICK_MS;
+    b->due_tick = now_tick + (ticks > 0 ? ticks : 1);
+    int slot = (int)(b->due_tick % WHEEL_SLOTS);
+    b->next = w->wheel[slot];
+    w->wheel[slot] = local;
+}
+
+static void pool_step(pool_worker_t *w, int local, long long tick) {
+    pool_boltun_t *b = &w->boltuns[local];
+    shared_data_t *shared = w->shared;
+    int id = w->index + local * w->workers;
 
-        sem_wait(&shared->data_lock);
-        shared->busy[target] = 0;
-        shared->busy[id] = 0;
-        sem_post(&shared->data_lock);
+    talker_stats_t *stats = shared_stats(shared, id);
 
-        log_message(shared, "[%d] завершил разговор с %d за %d c\n", id, target, talk_time);
+    if (b->phase == POOL_WAIT) {
+        int target = pick_target(shared, &b->rng, id);
+        stats_add(&stats->attempts, 1);
+        if (try_reserve(shared, id, target) != 0) {
+            w->rejected++;
+            stats_add(&stats->busy, 1);
+            b->duration = random_between(&b->rng, w->min_pause, w->max_pause);
+            wheel_insert(w, local, tick, b->duration);
+            return;
+        }
+        w->calls++;
+        log_message("[%d] звоню абоненту %d (ожидал %d c)\n", id, target, b->duration);
+        b->phase = POOL_TALK;
+        b->target = target;
+        b->duration = random_between(&b->rng, w->min_talk, w->max_talk);
+        wheel_insert(w, local, tick, b->duration);
+    } else {
+        release_pair(shared, id, b->target);
+        stats_add(&stats->calls, 1);
+        stats_add(&stats->talk_ms, (unsigned long)b->duration * 1000);
+        log_message("[%d] завершил разговор с %d за %d c\n", id, b->target, b->duration);
+        b->phase = POOL_WAIT;
+        b->duration = random_between(&b->rng, w->min_pause, w->max_pause);
+        wheel_insert(w, local, tick, b->duration);
+    }
+}
+
+static void *pool_worker(void *arg) {
+    pool_worker_t *w = arg;
+    shared_data_t *shared = w->shared;
+
+    for (int slot = 0; slot < WHEEL_SLOTS; ++slot) w->wheel[slot] = -1;
+    for (int local = 0; local < w->count; ++local) {
+        int id = w->index + local * w->workers;
+        stats_begin(shared_stats(shared, id));
+        prng_seed(&w->boltuns[local].rng, base_seed, (uint64_t)id);
+        w->boltuns[local].phase = POOL_WAIT;
+        w->boltuns[local].duration = random_between(&w->boltuns[local].rng, w->min_pause, w->max_pause);
+        wheel_insert(w, local, 0, w->boltuns[local].duration);
     }
 
-    log_message(shared, "[%d] завершает работу\n", id);
+    long long tick = 0;
+    while (!terminate_requested && !shared->stop_flag) {
+        long long now_tick = (monotonic_ms() - w->start_ms) / WHEEL_TICK_MS;
+        for (; tick <= now_tick; ++tick) {
+            int slot = (int)(tick % WHEEL_SLOTS);
+            int local = w->wheel[slot];
+            w->wheel[slot] = -1;
+            while (local != -1) {
+                int next = w->boltuns[local].next;
+                if (w->boltuns[local].due_tick > tick) {
+                    w->boltuns[local].next = w->wheel[slot];
+                    w->wheel[slot] = local;
+                } else {
+                    pool_step(w, local, tick);
+                }
+                local = next;
+            }
+        }
+
+        long long wake_ms = w->start_ms + tick * WHEEL_TICK_MS;
+        struct timespec ts = { wake_ms / 1000, (wake_ms % 1000) * 1000000 };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+
+    for (int local = 0; local < w->count; ++local) {
+        int id = w->index + local * w->workers;
+        if (w->boltuns[local].phase == POOL_TALK) {
+            release_pair(shared, id, w->boltuns[local].target);
+        }
+        stats_end(shared_stats(shared, id));
+        log_message("[%d] завершает работу\n", id);
+    }
+    return NULL;
+}
+
+static void run_pool(shared_data_t *shared, int workers, int simulation_time, int min_pause, int max_pause, int min_talk, int max_talk) {
+    int n = shared->num_boltuns;
+    if (workers > n) workers = n;
+    pool_worker_t *pool = calloc(workers, sizeof(pool_worker_t));
+    if (!pool) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    // Сигнал должен попадать в основной поток, а не прерывать сон рабочих.
+    sigset_t blocked, previous;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+
+    long long start_ms = monotonic_ms();
+    for (int i = 0; i < workers; ++i) {
+        pool_worker_t *w = &pool[i];
+        w->index = i;
+        w->workers = workers;
+        w->count = (n - i + workers - 1) / workers;
+        w->boltuns = calloc(w->count, sizeof(pool_boltun_t));
+        if (!w->boltuns) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        w->start_ms = start_ms;
+        w->min_pause = min_pause;
+        w->max_pause = max_pause;
+        w->min_talk = min_talk;
+        w->max_talk = max_talk;
+        w->shared = shared;
+        int rc = pthread_create(&w->thread, NULL, pool_worker, w);
+        if (rc != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    time_t start = time(NULL);
+    while (!terminate_requested && (time(NULL) - start < simulation_time)) {
+        sleep(1);
+    }
+    shared->stop_flag = 1;
+
+    unsigned long long calls = 0, rejected = 0;
+    for (int i = 0; i < workers; ++i) {
+        pthread_join(pool[i].thread, NULL);
+        calls += pool[i].calls;
+        rejected += pool[i].rejected;
+        free(pool[i].boltuns);
+    }
+    report_attempts(shared, calls, rejected);
+    free(pool);
+
+    double wall = (monotonic_ms() - start_ms) / 1000.0;
+    fprintf(stderr, "Пул потоков (%d): болтунов %d, звонков %llu, отказов %llu (откатов %lu) за %.1f c\n",
+            workers, n, calls, rejected, atomic_load(&shared->rollbacks), wall);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Использование: %s [--virtual-time | --threads [--workers W]] [--pick random|free] [--seed S] <число болтунов (<=%d, с пулом <=%d)> <длительность симуляции, с> [мин_пауза макс_пауза мин_разговор макс_разговор]\n", prog, MAX_BOLTUNS, MAX_POOL_BOLTUNS);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        fprintf(stderr, "Использование: %s <число болтунов (<=%d)> <длительность симуляции, с> [мин_ожид мин_разговор макс_разговор]\n", argv[0], MAX_BOLTUNS);
+    int virtual_time = 0;
+    int workers = 0;
+    int seed_given = 0;
+    char *positional[6];
+    int npos = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--virtual-time") == 0) {
+            virtual_time = 1;
+        } else if (strcmp(argv[i], "--pick") == 0 && i + 1 < argc) {
+            const char *policy = argv[++i];
+            if (strcmp(policy, "free") == 0) {
+                pick_policy = PICK_FREE;
+            } else if (strcmp(policy, "random") == 0) {
+                pick_policy = PICK_RANDOM;
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            base_seed = strtoull(argv[++i], NULL, 0);
+            seed_given = 1;
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            if (workers <= 0) workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+            if (workers <= 0) workers = 1;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+            if (workers <= 0) workers = 1;
+        } else if (npos < 6) {
+            positional[npos++] = argv[i];
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (npos < 2) {
+        usage(argv[0]);
         return EXIT_FAILURE;
     }
 
-    int n = atoi(argv[1]);
-    if (n <= 0 || n > MAX_BOLTUNS) {
+    int n = atoi(positional[0]);
+    int limit = (virtual_time || workers > 0) ? MAX_POOL_BOLTUNS : MAX_BOLTUNS;
+    if (n <= 0 || n > limit) {
         fprintf(stderr, "Некорректное число болтунов\n");
         return EXIT_FAILURE;
     }
 
-    int simulation_time = atoi(argv[2]);
+    int simulation_time = atoi(positional[1]);
     int min_pause = 1, max_pause = 3, min_talk = 1, max_talk = 4;
-    if (argc >= 6) {
-        min_pause = atoi(argv[3]);
-        max_pause = atoi(argv[4]);
-        min_talk = atoi(argv[5]);
-        if (argc >= 7) {
-            max_talk = atoi(argv[6]);
+    if (npos >= 5) {
+        min_pause = atoi(positional[2]);
+        max_pause = atoi(positional[3]);
+        min_talk = atoi(positional[4]);
+        if (npos >= 6) {
+            max_talk = atoi(positional[5]);
         }
     }
 
+    // Зерно печатается всегда, чтобы любой прогон можно было повторить.
+    if (!seed_given) base_seed = prng_default_seed();
+    fprintf(stderr, "Зерно: %llu\n", (unsigned long long)base_seed);
+
     signal(SIGINT, handle_sigint);
 
     int shm_fd = shm_open("/prog1_shared", O_CREAT | O_RDWR, 0666);
@@ -119,65 +559,89 @@ int main(int argc, char *argv[]) {
         perror("shm_open");
         return EXIT_FAILURE;
     }
-    if (ftruncate(shm_fd, sizeof(shared_data_t)) == -1) {
+    size_t shm_size = shared_size(n);
+    if (ftruncate(shm_fd, shm_size) == -1) {
         perror("ftruncate");
         return EXIT_FAILURE;
     }
 
-    shared_data_t *shared = mmap(NULL, sizeof(shared_data_t), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    shared_data_t *shared = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
     if (shared == MAP_FAILED) {
         perror("mmap");
         return EXIT_FAILURE;
     }
 
-    memset(shared, 0, sizeof(shared_data_t));
+    memset(shared, 0, shm_size);
     shared->num_boltuns = n;
-    sem_init(&shared->data_lock, 1, 1);
+    shared->stats_slots = stats_slot_count((uint32_t)n);
+    shared->stats_offset = shared_stats_offset(n);
     sem_init(&shared->print_lock, 1, 1);
 
-    pid_t *pids = calloc(n, sizeof(pid_t));
-    if (!pids) {
-        perror("calloc");
-        return EXIT_FAILURE;
-    }
-
-    for (int i = 0; i < n; ++i) {
-        pid_t pid = fork();
-        if (pid == -1) {
-            perror("fork");
+    pid_t *pids = NULL;
+    if (virtual_time) {
+        // Все болтуны живут в одном процессе, поэтому вывод можно буферизовать.
+        static char out_buffer[1 << 16];
+        setvbuf(stdout, out_buffer, _IOFBF, sizeof(out_buffer));
+        run_virtual(shared, simulation_time, min_pause, max_pause, min_talk, max_talk);
+    } else if (workers > 0) {
+        if (async_log_start(&shared->print_lock, &shared->print_stat) != 0) return EXIT_FAILURE;
+        run_pool(shared, workers, simulation_time, min_pause, max_pause, min_talk, max_talk);
+        async_log_stop();
+    } else {
+        pids = calloc(n, sizeof(pid_t));
+        if (!pids) {
+            perror("calloc");
             return EXIT_FAILURE;
         }
-        if (pid == 0) {
-            run_boltun(i, shared, min_pause, max_pause, min_talk, max_talk);
-            return EXIT_SUCCESS;
+
+        for (int i = 0; i < n; ++i) {
+            pid_t pid = fork();
+            if (pid == -1) {
+                perror("fork");
+                return EXIT_FAILURE;
+            }
+            if (pid == 0) {
+                if (async_log_start(&shared->print_lock, &shared->print_stat) != 0) return EXIT_FAILURE;
+                run_boltun(i, shared, min_pause, max_pause, min_talk, max_talk);
+                async_log_stop();
+                return EXIT_SUCCESS;
+            }
+            pids[i] = pid;
         }
-        pids[i] = pid;
-    }
 
-    time_t start = time(NULL);
-    while (!terminate_requested && (time(NULL) - start < simulation_time)) {
-        sleep(1);
-    }
+        time_t start = time(NULL);
+        while (!terminate_requested && (time(NULL) - start < simulation_time)) {
+            sleep(1);
+        }
 
-    sem_wait(&shared->data_lock);
-    shared->stop_flag = 1;
-    sem_post(&shared->data_lock);
+        shared->stop_flag = 1;
 
-    for (int i = 0; i < n; ++i) {
-        kill(pids[i], SIGINT);
-    }
+        for (int i = 0; i < n; ++i) {
+            kill(pids[i], SIGINT);
+        }
 
-    for (int i = 0; i < n; ++i) {
-        waitpid(pids[i], NULL, 0);
+        for (int i = 0; i < n; ++i) {
+            waitpid(pids[i], NULL, 0);
+        }
     }
 
-    sem_destroy(&shared->data_lock);
+    unsigned long rollbacks = atomic_load(&shared->rollbacks);
+    unsigned long attempts = atomic_load(&shared->attempts);
+    unsigned long wasted = atomic_load(&shared->wasted);
+    if (!virtual_time) {
+        // Построчный отчёт только для режима процессов, иначе строк слишком много.
+        stats_report(stdout, shared_stats(shared, 0), shared->stats_slots, (uint32_t)n, rollbacks, n <= MAX_BOLTUNS);
+        lockstat_print_header(stdout);
+        lockstat_print(stdout, "print_lock", &shared->print_stat);
+    }
     sem_destroy(&shared->print_lock);
-    munmap(shared, sizeof(shared_data_t));
+    munmap(shared, shm_size);
     close(shm_fd);
     shm_unlink("/prog1_shared");
 
     free(pids);
+    printf("Попыток звонка: %lu, впустую: %lu (%.1f%%), откатов резервирования: %lu\n",
+           attempts, wasted, attempts ? 100.0 * wasted / attempts : 0.0, rollbacks);
     printf("Родитель завершил работу\n");
     return EXIT_SUCCESS;
 }
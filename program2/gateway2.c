@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "exchange.h"
+#include "gateway.h"
+
+/*
+ * Шлюз станции федерации. Принимает запросы на Unix-сокете станции: от своих
+ * болтунов — звонки на другие станции, от шлюзов других станций — звонки на
+ * свои телефоны. Запрос к чужой станции пересылается её шлюзу, запрос к своей
+ * выполняется прямо в сегменте: телефон занимается с меткой pid шлюза,
+ * арендой из запроса и своей меткой звонка. На каждое соединение свой
+ * поток с блокирующим вводом, поэтому встречные пересылки двух шлюзов не
+ * ждут друг друга.
+ */
+#define SHM_NAME "/talker_shared"
+
+static exchange_t *shared = NULL;
+static uint32_t exchange_index = 0;
+static pid_t self_pid;
+static volatile sig_atomic_t terminate_requested = 0;
+
+static atomic_ulong prepared, refused, committed, released, forwarded, failed;
+static atomic_ulong next_token;
+
+/*
+ * Соединение с болтуном или шлюзом и его пересылочные сокеты. При остановке
+ * main разрывает все соединения и ждёт, пока потоки выйдут, и только потом
+ * отключается от сегмента. Пересылочные сокеты меняются под тем же мьютексом.
+ */
+typedef struct connection {
+    int fd;
+    int remote[GATEWAY_MAX_EXCHANGES];
+    struct connection *prev, *next;
+} connection_t;
+
+static pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t connections_gone = PTHREAD_COND_INITIALIZER;
+static connection_t *connections = NULL;
+static int closing = 0;
+
+static void handle_signal(int signo) {
+    (void)signo;
+    terminate_requested = 1;
+}
+
+static void handle_local(gateway_msg_t *msg) {
+    int capacity = (int)shared->capacity;
+    // Номер абонента выбирает звонящий, не зная ёмкости чужой станции.
+    int phone = msg->phone < 0 ? 0 : msg->phone % capacity;
+    switch (msg->type) {
+    case GATEWAY_PREPARE:
+        // Все телефоны шлюза помечены его pid, звонки различает метка.
+        msg->token = atomic_fetch_add(&next_token, 1) + 1;
+        if (exchange_reserve_phone(shared, phone, self_pid, msg->token, msg->lease_ms)) {
+            msg->type = GATEWAY_OK;
+            msg->phone = phone;
+            atomic_fetch_add(&prepared, 1);
+        } else {
+            msg->type = GATEWAY_BUSY;
+            atomic_fetch_add(&refused, 1);
+        }
+        break;
+    case GATEWAY_COMMIT:
+        if (exchange_renew_phone(shared, phone, self_pid, msg->token, msg->lease_ms)) {
+            exchange_call_set(shared, phone, msg->caller_exchange, msg->caller_phone, 0);
+            msg->type = GATEWAY_OK;
+            atomic_fetch_add(&committed, 1);
+            printf("[ш%u] %u:%d говорит с %d\n", exchange_index, msg->caller_exchange, msg->caller_phone, phone);
+            fflush(stdout);
+        } else {
+            msg->type = GATEWAY_ERROR;
+            atomic_fetch_add(&failed, 1);
+        }
+        break;
+    case GATEWAY_RELEASE:
+        // Если аренду уже забрал сборщик, телефон и его строка принадлежат другому звонку.
+        exchange_release_call(shared, phone, self_pid, msg->token);
+        msg->type = GATEWAY_OK;
+        atomic_fetch_add(&released, 1);
+        break;
+    default:
+        msg->type = GATEWAY_ERROR;
+        atomic_fetch_add(&failed, 1);
+    }
+}
+
+// Пересылка шлюзу другой станции; соединения открываются по мере надобности.
+static void forward(connection_t *conn, gateway_msg_t *msg) {
+    uint32_t exchange = msg->exchange;
+    if (exchange >= GATEWAY_MAX_EXCHANGES) {
+        msg->type = GATEWAY_ERROR;
+        return;
+    }
+    if (conn->remote[exchange] == -1) {
+        int fd = gateway_connect(exchange);
+        pthread_mutex_lock(&connections_lock);
+        if (closing && fd != -1) {
+            close(fd);
+            fd = -1;
+        }
+        conn->remote[exchange] = fd;
+        pthread_mutex_unlock(&connections_lock);
+    }
+    if (conn->remote[exchange] == -1 || gateway_request(conn->remote[exchange], msg) == GATEWAY_ERROR) {
+        pthread_mutex_lock(&connections_lock);
+        if (conn->remote[exchange] != -1) close(conn->remote[exchange]);
+        conn->remote[exchange] = -1;
+        pthread_mutex_unlock(&connections_lock);
+        msg->type = GATEWAY_ERROR;
+        atomic_fetch_add(&failed, 1);
+        return;
+    }
+    atomic_fetch_add(&forwarded, 1);
+}
+
+// Вызывается под connections_lock.
+static void connection_unlink(connection_t *conn) {
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        connections = conn->next;
+    }
+    if (conn->next) conn->next->prev = conn->prev;
+}
+
+static void *serve(void *arg) {
+    connection_t *conn = arg;
+    gateway_msg_t msg;
+    while (gateway_recv(conn->fd, &msg) == 0) {
+        if (msg.exchange == exchange_index) {
+            handle_local(&msg);
+        } else {
+            forward(conn, &msg);
+        }
+        if (gateway_send(conn->fd, &msg) == -1) break;
+    }
+
+    pthread_mutex_lock(&connections_lock);
+    connection_unlink(conn);
+    for (int i = 0; i < GATEWAY_MAX_EXCHANGES; ++i) {
+        if (conn->remote[i] != -1) close(conn->remote[i]);
+    }
+    close(conn->fd);
+    if (!connections) pthread_cond_broadcast(&connections_gone);
+    pthread_mutex_unlock(&connections_lock);
+    free(conn);
+    return NULL;
+}
+
+static connection_t *connection_add(int fd) {
+    connection_t *conn = calloc(1, sizeof(*conn));
+    if (!conn) return NULL;
+    conn->fd = fd;
+    for (int i = 0; i < GATEWAY_MAX_EXCHANGES; ++i) conn->remote[i] = -1;
+    pthread_mutex_lock(&connections_lock);
+    conn->next = connections;
+    if (connections) connections->prev = conn;
+    connections = conn;
+    pthread_mutex_unlock(&connections_lock);
+    return conn;
+}
+
+static void connection_remove(connection_t *conn) {
+    pthread_mutex_lock(&connections_lock);
+    connection_unlink(conn);
+    pthread_mutex_unlock(&connections_lock);
+    free(conn);
+}
+
+// Разрывает все соединения: recv и запросы к другим шлюзам в потоках завершаются.
+static void connections_shutdown(void) {
+    pthread_mutex_lock(&connections_lock);
+    closing = 1;
+    for (connection_t *conn = connections; conn; conn = conn->next) {
+        shutdown(conn->fd, SHUT_RDWR);
+        for (int i = 0; i < GATEWAY_MAX_EXCHANGES; ++i) {
+            if (conn->remote[i] != -1) shutdown(conn->remote[i], SHUT_RDWR);
+        }
+    }
+    while (connections) pthread_cond_wait(&connections_gone, &connections_lock);
+    pthread_mutex_unlock(&connections_lock);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Использование: %s [--exchange E]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--exchange") == 0 && i + 1 < argc) {
+            exchange_index = (uint32_t)atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (exchange_index >= GATEWAY_MAX_EXCHANGES) {
+        fprintf(stderr, "Некорректный номер станции (допустимо до %d)\n", GATEWAY_MAX_EXCHANGES);
+        return EXIT_FAILURE;
+    }
+
+    char shm_name[64];
+    gateway_station_name(shm_name, sizeof(shm_name), SHM_NAME, exchange_index);
+    shared = exchange_attach(shm_name);
+    if (!shared) {
+        fprintf(stderr, "Сначала создайте станцию: ./talker2 --init N --exchange %u --exchanges K\n", exchange_index);
+        return EXIT_FAILURE;
+    }
+    self_pid = getpid();
+
+    struct sockaddr_un addr;
+    gateway_address(&addr, exchange_index);
+    int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+    unlink(addr.sun_path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listen_fd, 64) == -1) {
+        perror("bind");
+        return EXIT_FAILURE;
+    }
+
+    // Без SA_RESTART, чтобы accept прерывался сигналом.
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf("[ш%u] шлюз слушает %s (телефонов %u)\n", exchange_index, addr.sun_path, shared->capacity);
+    fflush(stdout);
+
+    // Потоки соединений наследуют маску с заблокированными SIGINT и SIGTERM,
+    // поэтому сигнал всегда приходит в main и прерывает accept.
+    sigset_t stop_signals, saved_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (!terminate_requested) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+        connection_t *conn = connection_add(fd);
+        if (!conn) {
+            perror("calloc");
+            close(fd);
+            continue;
+        }
+        pthread_t thread;
+        pthread_sigmask(SIG_BLOCK, &stop_signals, &saved_mask);
+        int error = pthread_create(&thread, &attr, serve, conn);
+        pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+        if (error != 0) {
+            errno = error;
+            perror("pthread_create");
+            connection_remove(conn);
+            close(fd);
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    // Занятые шлюзом телефоны после выхода вернёт сборщик станции. От
+    // сегмента можно отключаться, только когда все потоки соединений вышли.
+    close(listen_fd);
+    unlink(addr.sun_path);
+    connections_shutdown();
+    printf("[ш%u] подготовлено %lu, занято %lu, подтверждено %lu, освобождено %lu, переслано %lu, ошибок %lu\n",
+           exchange_index, atomic_load(&prepared), atomic_load(&refused), atomic_load(&committed),
+           atomic_load(&released), atomic_load(&forwarded), atomic_load(&failed));
+    exchange_detach(shared);
+    return EXIT_SUCCESS;
+}
@@ -11,22 +11,29 @@
 #include <string.h>
 #include <semaphore.h>
 
-#define MAX_BOLTUNS 64
+#include "async_log.h"
+#include "exchange.h"
+#include "gateway.h"
+#include "prng.h"
+#include "reserve.h"
+
+#define DEFAULT_BOLTUNS 5
 #define SHM_NAME "/talker_shared"
-#define DATA_SEM "/talker_data_sem"
 #define PRINT_SEM "/talker_print_sem"
 
-typedef struct {
-    int num_boltuns;
-    int next_id;
-    int busy[MAX_BOLTUNS];
-    int stop_flag;
-} shared_data_t;
-
-static sem_t *data_sem = NULL;
 static sem_t *print_sem = NULL;
-static shared_data_t *shared = NULL;
+static exchange_t *shared = NULL;
+static talker_stats_t *stats = NULL;
 static volatile sig_atomic_t terminate_requested = 0;
+static int pick_free = 0;
+static int call_wait_ms = 0;
+static uint64_t base_seed;
+static prng_t rng;
+static char shm_name[64];
+static char print_sem_name[64];
+static uint32_t exchange_index = 0;
+static int remote_percent = 25;
+static int gateway_fd = -1;
 
 static void handle_sigint(int signo) {
     (void)signo;
@@ -35,138 +42,229 @@ static void handle_sigint(int signo) {
 }
 
 static int random_between(int min, int max) {
-    if (max <= min) return min;
-    return min + rand() % (max - min + 1);
+    return prng_between(&rng, min, max);
 }
 
+// Строка уходит в буфер процесса, print_sem берёт только поток вывода.
 static void log_message(const char *fmt, ...) {
     va_list args;
-    sem_wait(print_sem);
     va_start(args, fmt);
-    vprintf(fmt, args);
+    async_log_vprintf(fmt, args);
     va_end(args);
-    fflush(stdout);
-    sem_post(print_sem);
+}
+
+static int pick_target(int id) {
+    int capacity = (int)shared->capacity;
+    if (pick_free) {
+        return phone_bits_pick_free(exchange_busy(shared), capacity, id, (unsigned long)prng_next(&rng));
+    }
+    int target = id;
+    int attempts = 0;
+    while (target == id && attempts < 4 * capacity) {
+        target = (int)prng_below(&rng, (uint32_t)capacity);
+        attempts++;
+    }
+    return target;
 }
 
 static int acquire_id(void) {
-    sem_wait(data_sem);
-    int id = shared->next_id % shared->num_boltuns;
+    long long wait_start = stats_now_ns();
+    uint64_t acquired = exchange_lock(shared);
+    long long waited = (long long)acquired - wait_start;
+    int id = shared->next_id % (int)shared->capacity;
     shared->next_id++;
-    sem_post(data_sem);
+    exchange_unlock(shared, acquired);
+
+    stats = exchange_stats(shared, id);
+    stats_begin(stats);
+    stats_add(&stats->wait_ns, (unsigned long)waited);
     return id;
 }
 
-static void init_shared(int boltuns) {
-    int shm_fd = shm_open(SHM_NAME, O_CREAT | O_RDWR, 0666);
-    if (shm_fd == -1) {
-        perror("shm_open");
-        exit(EXIT_FAILURE);
-    }
-    if (ftruncate(shm_fd, sizeof(shared_data_t)) == -1) {
-        perror("ftruncate");
-        exit(EXIT_FAILURE);
-    }
-    shared_data_t *mem = mmap(NULL, sizeof(shared_data_t), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-    if (mem == MAP_FAILED) {
-        perror("mmap");
+static exchange_layout_t make_layout(int boltuns, int exchanges) {
+    exchange_layout_t layout = {
+        .capacity = (uint32_t)boltuns,
+        .exchange_index = exchange_index,
+        .exchange_count = (uint32_t)exchanges,
+    };
+    return layout;
+}
+
+static void init_shared(int boltuns, int exchanges) {
+    exchange_layout_t layout = make_layout(boltuns, exchanges);
+    if (exchange_create(shm_name, &layout, 0) == -1) {
         exit(EXIT_FAILURE);
     }
-    memset(mem, 0, sizeof(shared_data_t));
-    mem->num_boltuns = boltuns;
-    munmap(mem, sizeof(shared_data_t));
-    close(shm_fd);
 }
 
 static void open_shared(void) {
-    int shm_fd = shm_open(SHM_NAME, O_CREAT | O_RDWR, 0666);
-    if (shm_fd == -1) {
-        perror("shm_open");
-        exit(EXIT_FAILURE);
-    }
-    if (ftruncate(shm_fd, sizeof(shared_data_t)) == -1) {
-        perror("ftruncate");
+    // Без --init сегмент создаётся с настройками по умолчанию, если его ещё нет.
+    exchange_layout_t layout = make_layout(DEFAULT_BOLTUNS, 0);
+    shared = exchange_open(shm_name, &layout);
+    if (!shared) {
         exit(EXIT_FAILURE);
     }
-    shared = mmap(NULL, sizeof(shared_data_t), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-    if (shared == MAP_FAILED) {
-        perror("mmap");
-        exit(EXIT_FAILURE);
-    }
-    close(shm_fd);
-    if (shared->num_boltuns <= 0 || shared->num_boltuns > MAX_BOLTUNS) {
-        shared->num_boltuns = 5;
-    }
 }
 
 static void cleanup_resources(int unlink_all) {
     if (shared) {
-        munmap(shared, sizeof(shared_data_t));
+        exchange_detach(shared);
         shared = NULL;
     }
-    if (data_sem) {
-        sem_close(data_sem);
-        if (unlink_all) sem_unlink(DATA_SEM);
-    }
     if (print_sem) {
         sem_close(print_sem);
-        if (unlink_all) sem_unlink(PRINT_SEM);
+        if (unlink_all) sem_unlink(print_sem_name);
+    }
+    if (gateway_fd != -1) {
+        close(gateway_fd);
+        gateway_fd = -1;
     }
     if (unlink_all) {
-        shm_unlink(SHM_NAME);
+        shm_unlink(shm_name);
+    }
+}
+
+// Запрос к шлюзу своей станции; соединение открывается при первом звонке.
+static uint32_t gateway_call(gateway_msg_t *msg) {
+    if (gateway_fd == -1) {
+        gateway_fd = gateway_connect(exchange_index);
+        if (gateway_fd == -1) return GATEWAY_ERROR;
     }
+    uint32_t reply = gateway_request(gateway_fd, msg);
+    if (reply == GATEWAY_ERROR) {
+        close(gateway_fd);
+        gateway_fd = -1;
+    }
+    return reply;
+}
+
+/*
+ * Звонок на другую станцию. Фаза 1: свой телефон и телефон абонента
+ * занимаются с арендой GATEWAY_PREPARE_MS. Фаза 2: обе аренды продлеваются
+ * на время разговора; если одна из сторон не подтвердилась, обе
+ * освобождаются. Возвращает 0, если звонок не состоялся.
+ */
+static int remote_call(int id, pid_t pid, int pause, int min_talk, int max_talk) {
+    uint32_t exchanges = shared->exchange_count;
+    uint32_t exchange = (exchange_index + 1 + prng_below(&rng, exchanges - 1)) % exchanges;
+    if (!exchange_reserve_phone(shared, id, pid, 0, GATEWAY_PREPARE_MS)) return 0;
+
+    gateway_msg_t msg = {
+        .type = GATEWAY_PREPARE,
+        .exchange = exchange,
+        .phone = (int32_t)prng_below(&rng, shared->capacity),
+        .caller_exchange = exchange_index,
+        .caller_phone = id,
+        .lease_ms = GATEWAY_PREPARE_MS,
+    };
+    uint32_t reply = gateway_call(&msg);
+    if (reply != GATEWAY_OK) {
+        if (reply == GATEWAY_ERROR) log_message("[%d] шлюз станции %u недоступен\n", id, exchange_index);
+        exchange_release_phone(shared, id, pid);
+        return 0;
+    }
+
+    int talk_time = random_between(min_talk, max_talk);
+    uint32_t lease_ms = (uint32_t)talk_time * 1000 + EXCHANGE_LEASE_GRACE_MS;
+    msg.type = GATEWAY_COMMIT;
+    msg.lease_ms = lease_ms;
+    int committed = gateway_call(&msg) == GATEWAY_OK;
+    if (!committed || !exchange_renew_phone(shared, id, pid, 0, lease_ms) || shared->stop_flag) {
+        if (committed) {
+            msg.type = GATEWAY_RELEASE;
+            gateway_call(&msg);
+        }
+        exchange_release_phone(shared, id, pid);
+        return 0;
+    }
+
+    exchange_call_set(shared, id, exchange, msg.phone, 1);
+    log_message("[%d] звонит %u:%d через шлюз (пауза %d c)\n", id, exchange, msg.phone, pause);
+    sleep(talk_time);
+
+    exchange_call_set(shared, id, 0, -1, 0);
+    msg.type = GATEWAY_RELEASE;
+    gateway_call(&msg);
+    exchange_release_phone(shared, id, pid);
+
+    stats_add(&stats->calls, 1);
+    stats_add(&stats->talk_ms, (unsigned long)talk_time * 1000);
+    log_message("[%d] закончил разговор с %u:%d за %d c\n", id, exchange, msg.phone, talk_time);
+    return 1;
 }
 
 static void run_boltun(int min_pause, int max_pause, int min_talk, int max_talk, int duration) {
     int id = acquire_id();
-    srand((unsigned)time(NULL) ^ (getpid()<<16));
-    log_message("[%d] стартовал (болтунов=%d)\n", id, shared->num_boltuns);
+    prng_seed(&rng, base_seed, (uint64_t)id);
+    log_message("[%d] стартовал (болтунов=%d)\n", id, (int)shared->capacity);
 
+    // Аренда покрывает самый длинный разговор; после неё телефоны может забрать сборщик.
+    pid_t pid = getpid();
+    uint32_t lease_ms = (uint32_t)max_talk * 1000 + EXCHANGE_LEASE_GRACE_MS;
+    unsigned long attempts = 0, wasted = 0;
     time_t start = time(NULL);
     while (!terminate_requested && !shared->stop_flag && (time(NULL) - start < duration)) {
         int pause = random_between(min_pause, max_pause);
         sleep(pause);
         if (terminate_requested || shared->stop_flag) break;
 
-        int target = id;
-        int attempts = 0;
-        while (target == id && attempts < 4 * shared->num_boltuns) {
-            target = rand() % shared->num_boltuns;
+        exchange_reap_due(shared);
+        if (shared->exchange_count > 1 && (int)prng_below(&rng, 100) < remote_percent) {
             attempts++;
+            stats_add(&stats->attempts, 1);
+            if (!remote_call(id, pid, pause, min_talk, max_talk)) {
+                wasted++;
+                stats_add(&stats->busy, 1);
+            }
+            continue;
         }
-
-        sem_wait(data_sem);
-        if (shared->stop_flag || shared->busy[id] || shared->busy[target] || target == id) {
-            sem_post(data_sem);
+        int target = pick_target(id);
+        if (shared->stop_flag) break;
+        attempts++;
+        stats_add(&stats->attempts, 1);
+        // С --call-wait звонящий не уходит на новую паузу, а ждёт отбоя абонента.
+        if (target < 0 || (!exchange_reserve_pair(shared, id, target, pid, lease_ms) &&
+                           (call_wait_ms <= 0 || !exchange_wait_call(shared, id, target, pid, lease_ms, call_wait_ms)))) {
+            wasted++;
+            stats_add(&stats->busy, 1);
             continue;
         }
-        shared->busy[id] = 1;
-        shared->busy[target] = 1;
-        sem_post(data_sem);
+        if (shared->stop_flag) {
+            exchange_release_pair(shared, id, target, pid);
+            break;
+        }
 
+        exchange_call_begin(shared, id, target);
         log_message("[%d] звонит %d (пауза %d c)\n", id, target, pause);
         int talk_time = random_between(min_talk, max_talk);
         sleep(talk_time);
 
-        sem_wait(data_sem);
-        shared->busy[id] = 0;
-        shared->busy[target] = 0;
-        sem_post(data_sem);
+        exchange_call_end(shared, id, target);
+        exchange_release_pair(shared, id, target, pid);
 
+        stats_add(&stats->calls, 1);
+        stats_add(&stats->talk_ms, (unsigned long)talk_time * 1000);
         log_message("[%d] закончил разговор с %d за %d c\n", id, target, talk_time);
     }
 
-    log_message("[%d] завершает работу\n", id);
+    log_message("[%d] завершает работу (попыток %lu, впустую %lu, откатов резервирования: %lu)\n",
+                id, attempts, wasted, atomic_load(&shared->rollbacks));
+    stats_end(stats);
 }
 
 static void usage(const char *prog) {
-    fprintf(stderr, "Использование: %s [--init N] [--cleanup] [--duration sec] [мин_пауза макс_пауза мин_разговор макс_разговор]\n", prog);
+    fprintf(stderr, "Использование: %s [--init N] [--cleanup] [--stats] [--locks] [--snapshot] [--duration sec] [--pick random|free] [--seed S] [--call-wait ms] [--exchange E] [--exchanges K] [--remote P] [мин_пауза макс_пауза мин_разговор макс_разговор]\n", prog);
 }
 
 int main(int argc, char *argv[]) {
     int boltuns = 5;
+    int exchanges = 0;
     int do_init = 0;
     int do_cleanup = 0;
+    int show_stats = 0;
+    int show_locks = 0;
+    int show_snapshot = 0;
+    int seed_given = 0;
     int duration = 25;
     int min_pause = 1, max_pause = 3, min_talk = 1, max_talk = 4;
 
@@ -176,8 +274,33 @@ int main(int argc, char *argv[]) {
             boltuns = atoi(argv[++i]);
         } else if (strcmp(argv[i], "--cleanup") == 0) {
             do_cleanup = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            show_stats = 1;
+        } else if (strcmp(argv[i], "--locks") == 0) {
+            show_locks = 1;
+        } else if (strcmp(argv[i], "--snapshot") == 0) {
+            show_snapshot = 1;
         } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
             duration = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--call-wait") == 0 && i + 1 < argc) {
+            call_wait_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--exchange") == 0 && i + 1 < argc) {
+            exchange_index = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--exchanges") == 0 && i + 1 < argc) {
+            exchanges = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--remote") == 0 && i + 1 < argc) {
+            remote_percent = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            base_seed = strtoull(argv[++i], NULL, 0);
+            seed_given = 1;
+        } else if (strcmp(argv[i], "--pick") == 0 && i + 1 < argc) {
+            const char *policy = argv[++i];
+            if (strcmp(policy, "free") == 0) {
+                pick_free = 1;
+            } else if (strcmp(policy, "random") != 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
         } else if (min_pause == 1 && i + 3 < argc) {
             min_pause = atoi(argv[i]);
             max_pause = atoi(argv[i + 1]);
@@ -190,16 +313,34 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if (do_init) {
-        init_shared(boltuns);
+    if (exchange_index >= GATEWAY_MAX_EXCHANGES || exchanges < 0 || exchanges > GATEWAY_MAX_EXCHANGES ||
+        (exchanges > 0 && exchange_index >= (uint32_t)exchanges)) {
+        fprintf(stderr, "Некорректный номер станции или число станций (допустимо до %d)\n", GATEWAY_MAX_EXCHANGES);
+        return EXIT_FAILURE;
     }
+    gateway_station_name(shm_name, sizeof(shm_name), SHM_NAME, exchange_index);
+    gateway_station_name(print_sem_name, sizeof(print_sem_name), PRINT_SEM, exchange_index);
 
-    data_sem = sem_open(DATA_SEM, O_CREAT, 0666, 1);
-    if (data_sem == SEM_FAILED) {
-        perror("sem_open data");
-        return EXIT_FAILURE;
+    // --stats, --locks и --snapshot только читают состояние работающей станции.
+    if (show_stats || show_locks || show_snapshot) {
+        shared = exchange_attach(shm_name);
+        if (!shared) return EXIT_FAILURE;
+        if (show_stats) exchange_stats_report(shared, stdout);
+        if (show_locks) exchange_lockstat_report(shared, stdout);
+        if (show_snapshot) exchange_calls_report(shared, stdout);
+        exchange_detach(shared);
+        return EXIT_SUCCESS;
     }
-    print_sem = sem_open(PRINT_SEM, O_CREAT, 0666, 1);
+
+    if (do_init) {
+        if (boltuns < 2 || boltuns > EXCHANGE_MAX_PHONES) {
+            fprintf(stderr, "Некорректное число болтунов (допустимо 2..%d)\n", EXCHANGE_MAX_PHONES);
+            return EXIT_FAILURE;
+        }
+        init_shared(boltuns, exchanges);
+    }
+
+    print_sem = sem_open(print_sem_name, O_CREAT, 0666, 1);
     if (print_sem == SEM_FAILED) {
         perror("sem_open print");
         return EXIT_FAILURE;
@@ -207,8 +348,12 @@ int main(int argc, char *argv[]) {
 
     open_shared();
 
+    if (!seed_given) base_seed = prng_default_seed();
+    fprintf(stderr, "Зерно: %llu\n", (unsigned long long)base_seed);
+    if (async_log_start(print_sem, &shared->locks[EXCHANGE_LOCK_PRINT]) != 0) return EXIT_FAILURE;
     signal(SIGINT, handle_sigint);
     run_boltun(min_pause, max_pause, min_talk, max_talk, duration);
+    async_log_stop();
 
     cleanup_resources(do_cleanup);
     return EXIT_SUCCESS;
@@ -6,9 +6,16 @@
 #include <mqueue.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <sys/epoll.h>
 
+#include "event.h"
+#include "exchange.h"
+
+#define SHM_NAME "/talker3_shared"
 #define MQ_NAME "/talker3_queue"
-#define MQ_MSG_SIZE 256
+#define MQ_MAX_SHARDS 64
+#define REORDER_WINDOW_MS 20
 
 static volatile sig_atomic_t stop_requested = 0;
 
@@ -17,37 +24,170 @@ static void handle_sigint(int signo) {
     stop_requested = 1;
 }
 
+static void shard_name(char *name, size_t size, int shard) {
+    snprintf(name, size, "%s_%d", MQ_NAME, shard);
+}
+
+/*
+ * События из разных очередей складываются в кучу по времени и выводятся,
+ * когда становятся старше окна упорядочивания REORDER_WINDOW_MS.
+ */
+typedef struct {
+    event_record_t *items;
+    size_t size;
+    size_t cap;
+} event_heap_t;
+
+static int event_before(const event_record_t *a, const event_record_t *b) {
+    if (a->timestamp_ns != b->timestamp_ns) return a->timestamp_ns < b->timestamp_ns;
+    if (a->talker != b->talker) return a->talker < b->talker;
+    return a->sequence < b->sequence;
+}
+
+static void heap_push(event_heap_t *heap, const event_record_t *ev) {
+    if (heap->size == heap->cap) {
+        size_t cap = heap->cap ? heap->cap * 2 : 256;
+        event_record_t *items = realloc(heap->items, cap * sizeof(event_record_t));
+        if (!items) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        heap->items = items;
+        heap->cap = cap;
+    }
+    size_t i = heap->size++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!event_before(ev, &heap->items[parent])) break;
+        heap->items[i] = heap->items[parent];
+        i = parent;
+    }
+    heap->items[i] = *ev;
+}
+
+static event_record_t heap_pop(event_heap_t *heap) {
+    event_record_t top = heap->items[0];
+    event_record_t last = heap->items[--heap->size];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= heap->size) break;
+        if (child + 1 < heap->size && event_before(&heap->items[child + 1], &heap->items[child])) child++;
+        if (!event_before(&heap->items[child], &last)) break;
+        heap->items[i] = heap->items[child];
+        i = child;
+    }
+    if (heap->size > 0) heap->items[i] = last;
+    return top;
+}
+
+// Выводит события старше границы; возвращает 1, если встретился STOP.
+static int emit_until(event_heap_t *heap, uint64_t limit_ns) {
+    char text[128];
+    while (heap->size > 0 && heap->items[0].timestamp_ns <= limit_ns) {
+        event_record_t ev = heap_pop(heap);
+        if (ev.type == EVENT_STOP) {
+            printf("Получен сигнал остановки, наблюдатель завершает работу.\n");
+            return 1;
+        }
+        event_render(&ev, text, sizeof(text));
+        printf("[OBS] %s", text);
+    }
+    fflush(stdout);
+    return 0;
+}
+
+static void drain_queue(mqd_t mq, char *buffer, long msgsize, event_heap_t *heap) {
+    for (;;) {
+        ssize_t bytes = mq_receive(mq, buffer, (size_t)msgsize, NULL);
+        if (bytes < 0) break;
+        if ((size_t)bytes < sizeof(event_batch_t)) continue;
+        const event_batch_t *batch = (const event_batch_t *)buffer;
+        unsigned count = batch->count;
+        unsigned fits = (unsigned)(((size_t)bytes - sizeof(event_batch_t)) / sizeof(event_record_t));
+        if (count > fits) count = fits;
+        for (unsigned i = 0; i < count; ++i) {
+            heap_push(heap, &batch->events[i]);
+        }
+    }
+}
+
 int main(void) {
     signal(SIGINT, handle_sigint);
 
-    struct mq_attr attr = {0};
-    attr.mq_maxmsg = 10;
-    attr.mq_msgsize = MQ_MSG_SIZE;
+    // Число очередей задаётся при --init и хранится в заголовке сегмента.
+    int shards = 1;
+    exchange_t *shared = exchange_attach(SHM_NAME);
+    if (shared) {
+        if (shared->queue_shards > 0 && shared->queue_shards <= MQ_MAX_SHARDS) shards = (int)shared->queue_shards;
+        exchange_detach(shared);
+    }
 
-    mqd_t mq = mq_open(MQ_NAME, O_CREAT | O_RDONLY, 0666, &attr);
-    if (mq == (mqd_t)-1) {
-        perror("mq_open");
+    int epfd = epoll_create1(0);
+    if (epfd == -1) {
+        perror("epoll_create1");
         return EXIT_FAILURE;
     }
 
-    printf("Наблюдатель готов к приёму сообщений...\n");
-    char buffer[MQ_MSG_SIZE];
+    mqd_t queues[MQ_MAX_SHARDS];
+    long msgsize = 0;
+    for (int shard = 0; shard < shards; ++shard) {
+        char name[64];
+        struct mq_attr attr = {0};
+        attr.mq_maxmsg = 10;
+        attr.mq_msgsize = (long)event_batch_size(1);
+        shard_name(name, sizeof(name), shard);
+        queues[shard] = mq_open(name, O_CREAT | O_RDONLY | O_NONBLOCK, 0666, &attr);
+        if (queues[shard] == (mqd_t)-1) {
+            perror("mq_open");
+            return EXIT_FAILURE;
+        }
+        // Очередь могла быть создана раньше с другим размером сообщения.
+        if (mq_getattr(queues[shard], &attr) == -1) {
+            perror("mq_getattr");
+            return EXIT_FAILURE;
+        }
+        if (attr.mq_msgsize > msgsize) msgsize = attr.mq_msgsize;
 
-    while (!stop_requested) {
-        ssize_t bytes = mq_receive(mq, buffer, sizeof(buffer), NULL);
-        if (bytes >= 0) {
-            if (strncmp(buffer, "STOP", 4) == 0) {
-                printf("Получен сигнал остановки, наблюдатель завершает работу.\n");
-                break;
-            }
-            buffer[bytes] = '\0';
-            printf("[OBS] %s", buffer);
-            fflush(stdout);
-        } else {
-            usleep(100000);
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.u32 = (uint32_t)shard;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, (int)queues[shard], &ev) == -1) {
+            perror("epoll_ctl");
+            return EXIT_FAILURE;
         }
     }
 
-    mq_close(mq);
+    char *buffer = malloc((size_t)msgsize);
+    if (!buffer) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+
+    printf("Наблюдатель готов к приёму сообщений из %d очередей...\n", shards);
+    event_heap_t heap = {0};
+    struct epoll_event ready[MQ_MAX_SHARDS];
+    int stop = 0;
+
+    while (!stop_requested && !stop) {
+        int timeout = heap.size > 0 ? REORDER_WINDOW_MS : -1;
+        int n = epoll_wait(epfd, ready, shards, timeout);
+        if (n == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            drain_queue(queues[ready[i].data.u32], buffer, msgsize, &heap);
+        }
+        stop = emit_until(&heap, event_now_ns() - (uint64_t)REORDER_WINDOW_MS * 1000000);
+    }
+    if (!stop) emit_until(&heap, UINT64_MAX);
+
+    free(heap.items);
+    free(buffer);
+    for (int shard = 0; shard < shards; ++shard) {
+        mq_close(queues[shard]);
+    }
+    close(epfd);
     return EXIT_SUCCESS;
 }
@@ -11,26 +11,39 @@
 #include <string.h>
 #include <semaphore.h>
 #include <mqueue.h>
+#include <errno.h>
 
-#define MAX_BOLTUNS 64
+#include "async_log.h"
+#include "event.h"
+#include "exchange.h"
+#include "prng.h"
+#include "reserve.h"
+
+#define DEFAULT_BOLTUNS 5
 #define SHM_NAME "/talker3_shared"
-#define DATA_SEM "/talker3_data_sem"
 #define PRINT_SEM "/talker3_print_sem"
 #define MQ_NAME "/talker3_queue"
-#define MQ_MSG_SIZE 256
-
-typedef struct {
-    int num_boltuns;
-    int next_id;
-    int busy[MAX_BOLTUNS];
-    int stop_flag;
-} shared_data_t;
+#define MQ_MAX_SHARDS 64
+/* Сколько завершающая пачка со STOP ждёт места в очереди. */
+#define MQ_FINAL_SEND_MS 5000
 
-static sem_t *data_sem = NULL;
 static sem_t *print_sem = NULL;
-static shared_data_t *shared = NULL;
+static exchange_t *shared = NULL;
+static talker_stats_t *stats = NULL;
 static mqd_t mq = (mqd_t)-1;
+static event_batch_t *batch = NULL;
+static unsigned batch_capacity = 1;
+static unsigned long events_sent = 0;
+static unsigned long events_dropped = 0;
+static unsigned long events_failed = 0;
+static int final_send = 0;
+static struct timespec final_deadline;
 static volatile sig_atomic_t terminate_requested = 0;
+static int pick_free = 0;
+static int call_wait_ms = 0;
+static uint64_t base_seed;
+static prng_t rng;
+static int queue_shards = 1;
 
 static void handle_sigint(int signo) {
     (void)signo;
@@ -39,86 +52,136 @@ static void handle_sigint(int signo) {
 }
 
 static int random_between(int min, int max) {
-    if (max <= min) return min;
-    return min + rand() % (max - min + 1);
+    return prng_between(&rng, min, max);
 }
 
-static void broadcast(const char *fmt, ...) {
-    char buffer[MQ_MSG_SIZE];
+// Строка уходит в буфер процесса, print_sem берёт только поток вывода.
+static void print_local(const char *fmt, ...) {
     va_list args;
-
-    sem_wait(print_sem);
     va_start(args, fmt);
-    vsnprintf(buffer, sizeof(buffer), fmt, args);
+    async_log_vprintf(fmt, args);
     va_end(args);
+}
 
-    va_start(args, fmt);
-    vprintf(fmt, args);
-    va_end(args);
-    fflush(stdout);
-    sem_post(print_sem);
+/*
+ * События копятся в пачке и уходят одним сообщением без блокировки:
+ * если очередь заполнена, пачка отбрасывается и учитывается в счётчике.
+ * Прочие ошибки отправки считаются отдельно. После finish_events пачки
+ * ждут места в очереди до общего срока final_deadline.
+ */
+static void flush_events(void) {
+    if (!batch || batch->count == 0) return;
+    size_t size = event_batch_size(batch->count);
+    int result;
+    if (final_send) {
+        while ((result = mq_timedsend(mq, (const char *)batch, size, 0, &final_deadline)) == -1 && errno == EINTR) {
+        }
+    } else {
+        result = mq_send(mq, (const char *)batch, size, 0);
+    }
+    if (result == 0) {
+        events_sent += batch->count;
+    } else if (errno == EAGAIN || errno == ETIMEDOUT) {
+        events_dropped += batch->count;
+    } else {
+        events_failed += batch->count;
+    }
+    batch->count = 0;
+}
+
+/*
+ * EXIT и STOP отбрасывать нельзя: без STOP наблюдатель не завершится.
+ * Очередь переводится в блокирующий режим, и последние пачки ждут места
+ * до MQ_FINAL_SEND_MS, чтобы болтун не завис, если наблюдателя уже нет.
+ */
+static void finish_events(void) {
+    struct mq_attr blocking = {0};
+    mq_setattr(mq, &blocking, NULL);
+    clock_gettime(CLOCK_REALTIME, &final_deadline);
+    final_deadline.tv_sec += MQ_FINAL_SEND_MS / 1000;
+    final_send = 1;
+    flush_events();
+}
+
+static void queue_event(const event_record_t *ev) {
+    batch->events[batch->count++] = *ev;
+    if (batch->count >= batch_capacity) flush_events();
+}
+
+static void send_event(int type, int id, int target, int duration) {
+    event_record_t ev = event_make(type, id, target, duration);
+    queue_event(&ev);
+}
+
+// Наблюдателю уходит двоичная запись, текст строится только для своей консоли.
+static void broadcast(int type, int id, int target, int duration) {
+    event_record_t ev = event_make(type, id, target, duration);
+    char text[128];
 
-    mq_send(mq, buffer, strlen(buffer) + 1, 0);
+    queue_event(&ev);
+    event_render(&ev, text, sizeof(text));
+    print_local("%s", text);
+}
+
+static int pick_target(int id) {
+    int capacity = (int)shared->capacity;
+    if (pick_free) {
+        return phone_bits_pick_free(exchange_busy(shared), capacity, id, (unsigned long)prng_next(&rng));
+    }
+    int target = id;
+    int attempts = 0;
+    while (target == id && attempts < 4 * capacity) {
+        target = (int)prng_below(&rng, (uint32_t)capacity);
+        attempts++;
+    }
+    return target;
+}
+
+// Очередь болтуна выбирается по его номеру: /talker3_queue_<id % K>.
+static void shard_name(char *name, size_t size, int shard) {
+    snprintf(name, size, "%s_%d", MQ_NAME, shard);
 }
 
 static int acquire_id(void) {
-    sem_wait(data_sem);
-    int id = shared->next_id % shared->num_boltuns;
+    long long wait_start = stats_now_ns();
+    uint64_t acquired = exchange_lock(shared);
+    long long waited = (long long)acquired - wait_start;
+    int id = shared->next_id % (int)shared->capacity;
     shared->next_id++;
-    sem_post(data_sem);
+    exchange_unlock(shared, acquired);
+
+    stats = exchange_stats(shared, id);
+    stats_begin(stats);
+    stats_add(&stats->wait_ns, (unsigned long)waited);
     return id;
 }
 
+static exchange_layout_t make_layout(int boltuns) {
+    exchange_layout_t layout = { .capacity = (uint32_t)boltuns, .queue_shards = (uint32_t)queue_shards };
+    return layout;
+}
+
 static void init_shared(int boltuns) {
-    int shm_fd = shm_open(SHM_NAME, O_CREAT | O_RDWR, 0666);
-    if (shm_fd == -1) {
-        perror("shm_open");
-        exit(EXIT_FAILURE);
-    }
-    if (ftruncate(shm_fd, sizeof(shared_data_t)) == -1) {
-        perror("ftruncate");
-        exit(EXIT_FAILURE);
-    }
-    shared_data_t *mem = mmap(NULL, sizeof(shared_data_t), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-    if (mem == MAP_FAILED) {
-        perror("mmap");
+    exchange_layout_t layout = make_layout(boltuns);
+    if (exchange_create(SHM_NAME, &layout, 0) == -1) {
         exit(EXIT_FAILURE);
     }
-    memset(mem, 0, sizeof(shared_data_t));
-    mem->num_boltuns = boltuns;
-    munmap(mem, sizeof(shared_data_t));
-    close(shm_fd);
 }
 
 static void open_shared(void) {
-    int shm_fd = shm_open(SHM_NAME, O_CREAT | O_RDWR, 0666);
-    if (shm_fd == -1) {
-        perror("shm_open");
-        exit(EXIT_FAILURE);
-    }
-    if (ftruncate(shm_fd, sizeof(shared_data_t)) == -1) {
-        perror("ftruncate");
+    // Без --init сегмент создаётся с настройками по умолчанию, если его ещё нет.
+    exchange_layout_t layout = make_layout(DEFAULT_BOLTUNS);
+    shared = exchange_open(SHM_NAME, &layout);
+    if (!shared) {
         exit(EXIT_FAILURE);
     }
-    shared = mmap(NULL, sizeof(shared_data_t), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-    if (shared == MAP_FAILED) {
-        perror("mmap");
-        exit(EXIT_FAILURE);
-    }
-    close(shm_fd);
-    if (shared->num_boltuns <= 0 || shared->num_boltuns > MAX_BOLTUNS) {
-        shared->num_boltuns = 5;
-    }
 }
 
 static void cleanup_resources(int unlink_all) {
     if (shared) {
-        munmap(shared, sizeof(shared_data_t));
+        exchange_detach(shared);
         shared = NULL;
     }
-    if (data_sem) {
-        sem_close(data_sem);
-    }
     if (print_sem) {
         sem_close(print_sem);
     }
@@ -126,66 +189,89 @@ static void cleanup_resources(int unlink_all) {
         mq_close(mq);
     }
     if (unlink_all) {
-        sem_unlink(DATA_SEM);
         sem_unlink(PRINT_SEM);
-        mq_unlink(MQ_NAME);
+        char name[64];
+        for (int shard = 0; shard < MQ_MAX_SHARDS; ++shard) {
+            shard_name(name, sizeof(name), shard);
+            mq_unlink(name);
+        }
         shm_unlink(SHM_NAME);
     }
 }
 
-static void run_boltun(int min_pause, int max_pause, int min_talk, int max_talk, int duration) {
-    int id = acquire_id();
-    srand((unsigned)time(NULL) ^ (getpid()<<16));
-    broadcast("[%d] стартовал (болтунов=%d)\n", id, shared->num_boltuns);
+static void run_boltun(int id, int min_pause, int max_pause, int min_talk, int max_talk, int duration) {
+    prng_seed(&rng, base_seed, (uint64_t)id);
+    broadcast(EVENT_START, id, (int)shared->capacity, 0);
 
+    // Аренда покрывает самый длинный разговор; после неё телефоны может забрать сборщик.
+    pid_t pid = getpid();
+    uint32_t lease_ms = (uint32_t)max_talk * 1000 + EXCHANGE_LEASE_GRACE_MS;
+    unsigned long attempts = 0, wasted = 0;
     time_t start = time(NULL);
     while (!terminate_requested && !shared->stop_flag && (time(NULL) - start < duration)) {
         int pause = random_between(min_pause, max_pause);
+        flush_events();
         sleep(pause);
         if (terminate_requested || shared->stop_flag) break;
 
-        int target = id;
-        int attempts = 0;
-        while (target == id && attempts < 4 * shared->num_boltuns) {
-            target = rand() % shared->num_boltuns;
-            attempts++;
-        }
-
-        sem_wait(data_sem);
-        if (shared->stop_flag || shared->busy[id] || shared->busy[target] || target == id) {
-            sem_post(data_sem);
+        exchange_reap_due(shared);
+        int target = pick_target(id);
+        if (shared->stop_flag) break;
+        attempts++;
+        stats_add(&stats->attempts, 1);
+        // С --call-wait звонящий не уходит на новую паузу, а ждёт отбоя абонента.
+        if (target < 0 || (!exchange_reserve_pair(shared, id, target, pid, lease_ms) &&
+                           (call_wait_ms <= 0 || !exchange_wait_call(shared, id, target, pid, lease_ms, call_wait_ms)))) {
+            wasted++;
+            stats_add(&stats->busy, 1);
             continue;
         }
-        shared->busy[id] = 1;
-        shared->busy[target] = 1;
-        sem_post(data_sem);
+        if (shared->stop_flag) {
+            exchange_release_pair(shared, id, target, pid);
+            break;
+        }
 
-        broadcast("[%d] звонит %d (пауза %d c)\n", id, target, pause);
+        exchange_call_begin(shared, id, target);
+        broadcast(EVENT_CALL, id, target, pause);
         int talk_time = random_between(min_talk, max_talk);
+        flush_events();
         sleep(talk_time);
 
-        sem_wait(data_sem);
-        shared->busy[id] = 0;
-        shared->busy[target] = 0;
-        sem_post(data_sem);
+        exchange_call_end(shared, id, target);
+        exchange_release_pair(shared, id, target, pid);
 
-        broadcast("[%d] закончил разговор с %d за %d c\n", id, target, talk_time);
+        stats_add(&stats->calls, 1);
+        stats_add(&stats->talk_ms, (unsigned long)talk_time * 1000);
+        broadcast(EVENT_HANGUP, id, target, talk_time);
     }
 
-    broadcast("[%d] завершает работу\n", id);
-    mq_send(mq, "STOP", 5, 0);
+    finish_events();
+    send_event(EVENT_EXIT, id, -1, 0);
+    send_event(EVENT_STOP, id, -1, 0);
+    flush_events();
+    print_local("[%d] завершает работу (попыток %lu, впустую %lu, откатов резервирования: %lu)\n",
+                id, attempts, wasted, atomic_load(&shared->rollbacks));
+    stats_end(stats);
+    print_local("[%d] событий отправлено %lu, отброшено из-за заполненной очереди %lu, потеряно из-за ошибок %lu\n",
+                id, events_sent, events_dropped, events_failed);
 }
 
 static void usage(const char *prog) {
-    fprintf(stderr, "Использование: %s [--init N] [--cleanup] [--duration sec] [мин_пауза макс_пауза мин_разговор макс_разговор]\n", prog);
+    fprintf(stderr, "Использование: %s [--init N] [--cleanup] [--stats] [--locks] [--snapshot] [--duration sec] [--pick random|free] [--seed S] [--call-wait ms] [--queue-depth N] [--batch K] [--shards K] [мин_пауза макс_пауза мин_разговор макс_разговор]\n", prog);
 }
 
 int main(int argc, char *argv[]) {
     int boltuns = 5;
     int do_init = 0;
     int do_cleanup = 0;
+    int show_stats = 0;
+    int show_locks = 0;
+    int show_snapshot = 0;
+    int seed_given = 0;
     int duration = 25;
     int min_pause = 1, max_pause = 3, min_talk = 1, max_talk = 4;
+    int queue_depth = 10;
+    int batch_size = 1;
 
     for (int i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "--init") == 0 && i + 1 < argc) {
@@ -193,8 +279,33 @@ int main(int argc, char *argv[]) {
             boltuns = atoi(argv[++i]);
         } else if (strcmp(argv[i], "--cleanup") == 0) {
             do_cleanup = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            show_stats = 1;
+        } else if (strcmp(argv[i], "--locks") == 0) {
+            show_locks = 1;
+        } else if (strcmp(argv[i], "--snapshot") == 0) {
+            show_snapshot = 1;
         } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
             duration = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--queue-depth") == 0 && i + 1 < argc) {
+            queue_depth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            queue_shards = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--call-wait") == 0 && i + 1 < argc) {
+            call_wait_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            base_seed = strtoull(argv[++i], NULL, 0);
+            seed_given = 1;
+        } else if (strcmp(argv[i], "--pick") == 0 && i + 1 < argc) {
+            const char *policy = argv[++i];
+            if (strcmp(policy, "free") == 0) {
+                pick_free = 1;
+            } else if (strcmp(policy, "random") != 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
         } else if (min_pause == 1 && i + 3 < argc) {
             min_pause = atoi(argv[i]);
             max_pause = atoi(argv[i + 1]);
@@ -212,15 +323,29 @@ int main(int argc, char *argv[]) {
         return EXIT_SUCCESS;
     }
 
+    // --stats, --locks и --snapshot только читают состояние работающей станции.
+    if (show_stats || show_locks || show_snapshot) {
+        shared = exchange_attach(SHM_NAME);
+        if (!shared) return EXIT_FAILURE;
+        if (show_stats) exchange_stats_report(shared, stdout);
+        if (show_locks) exchange_lockstat_report(shared, stdout);
+        if (show_snapshot) exchange_calls_report(shared, stdout);
+        exchange_detach(shared);
+        return EXIT_SUCCESS;
+    }
+
     if (do_init) {
+        if (boltuns < 2 || boltuns > EXCHANGE_MAX_PHONES) {
+            fprintf(stderr, "Некорректное число болтунов (допустимо 2..%d)\n", EXCHANGE_MAX_PHONES);
+            return EXIT_FAILURE;
+        }
+        if (queue_shards < 1 || queue_shards > MQ_MAX_SHARDS) {
+            fprintf(stderr, "Некорректное число очередей (допустимо 1..%d)\n", MQ_MAX_SHARDS);
+            return EXIT_FAILURE;
+        }
         init_shared(boltuns);
     }
 
-    data_sem = sem_open(DATA_SEM, O_CREAT, 0666, 1);
-    if (data_sem == SEM_FAILED) {
-        perror("sem_open data");
-        return EXIT_FAILURE;
-    }
     print_sem = sem_open(PRINT_SEM, O_CREAT, 0666, 1);
     if (print_sem == SEM_FAILED) {
         perror("sem_open print");
@@ -229,18 +354,60 @@ int main(int argc, char *argv[]) {
 
     open_shared();
 
+    if (queue_depth <= 0 || batch_size <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Параметры очередей фиксируются при создании, поэтому --init пересоздаёт их.
+    char name[64];
+    if (do_init) {
+        for (int shard = 0; shard < MQ_MAX_SHARDS; ++shard) {
+            shard_name(name, sizeof(name), shard);
+            mq_unlink(name);
+        }
+    }
+    int id = acquire_id();
+    int shards = shared->queue_shards > 0 ? (int)shared->queue_shards : 1;
+    shard_name(name, sizeof(name), id % shards);
     struct mq_attr attr = {0};
-    attr.mq_maxmsg = 10;
-    attr.mq_msgsize = MQ_MSG_SIZE;
-    mq = mq_open(MQ_NAME, O_CREAT | O_WRONLY, 0666, &attr);
+    attr.mq_maxmsg = queue_depth;
+    attr.mq_msgsize = (long)event_batch_size((unsigned)batch_size);
+    mq = mq_open(name, O_CREAT | O_WRONLY | O_NONBLOCK, 0666, &attr);
     if (mq == (mqd_t)-1) {
         perror("mq_open");
+        if (errno == EINVAL) {
+            fprintf(stderr, "Глубина очереди и размер пачки ограничены /proc/sys/fs/mqueue/msg_max и msgsize_max\n");
+        }
+        return EXIT_FAILURE;
+    }
+    if (mq_getattr(mq, &attr) == -1) {
+        perror("mq_getattr");
+        return EXIT_FAILURE;
+    }
+    // Если очередь уже была создана с меньшими сообщениями, пачка уменьшается.
+    batch_capacity = (unsigned)batch_size;
+    if ((size_t)attr.mq_msgsize < event_batch_size(batch_capacity)) {
+        batch_capacity = (unsigned)(((size_t)attr.mq_msgsize - sizeof(event_batch_t)) / sizeof(event_record_t));
+    }
+    if (batch_capacity == 0) {
+        fprintf(stderr, "Очередь %s создана с несовместимым размером сообщения, выполните --init\n", name);
+        return EXIT_FAILURE;
+    }
+    batch = calloc(1, event_batch_size(batch_capacity));
+    if (!batch) {
+        perror("calloc");
         return EXIT_FAILURE;
     }
 
+    if (!seed_given) base_seed = prng_default_seed();
+    fprintf(stderr, "Зерно: %llu\n", (unsigned long long)base_seed);
+    if (async_log_start(print_sem, &shared->locks[EXCHANGE_LOCK_PRINT]) != 0) return EXIT_FAILURE;
     signal(SIGINT, handle_sigint);
-    run_boltun(min_pause, max_pause, min_talk, max_talk, duration);
+    run_boltun(id, min_pause, max_pause, min_talk, max_talk, duration);
+    async_log_stop();
 
     cleanup_resources(do_cleanup);
+    free(batch);
     return EXIT_SUCCESS;
 }
@@ -7,22 +7,18 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
-#include <semaphore.h>
+
+#include "event.h"
+#include "exchange.h"
+#include "journal.h"
+#include "ring.h"
 
 #define SHM_NAME "/talker4_shared"
-#define LOG_SEM "/talker4_log_sem"
-#define PRINT_SEM "/talker4_print_sem"
-#define LOG_CAP 256
-#define LOG_LEN 180
-
-typedef struct {
-    int num_boltuns;
-    int next_id;
-    int busy[64];
-    int stop_flag;
-    unsigned long seq;
-    char log_buffer[LOG_CAP][LOG_LEN];
-} shared_data_t;
+#define STALL_LIMIT_MS 1000
+// Отсеянные фильтром события сдвигают опубликованный курсор пачками.
+#define FILTER_PUBLISH_EVERY 64
+
+static const char *const event_names[] = { "start", "call", "hangup", "exit", "stop" };
 
 static volatile sig_atomic_t stop_requested = 0;
 
@@ -31,64 +27,220 @@ static void handle_sigint(int signo) {
     stop_requested = 1;
 }
 
-int main(void) {
-    signal(SIGINT, handle_sigint);
+static void report_skipped(exchange_observer_t *self, unsigned long *pending) {
+    if (*pending == 0) return;
+    atomic_fetch_add(&self->skipped, *pending);
+    printf("[OBS4] пропущено %lu событий\n", *pending);
+    *pending = 0;
+}
 
-    int shm_fd = shm_open(SHM_NAME, O_CREAT | O_RDWR, 0666);
-    if (shm_fd == -1) {
-        perror("shm_open");
-        return EXIT_FAILURE;
+static int parse_events(const char *list, uint32_t *kinds) {
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer), "%s", list);
+    *kinds = 0;
+    for (char *save = NULL, *name = strtok_r(buffer, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        size_t i = 0;
+        while (i < sizeof(event_names) / sizeof(event_names[0]) && strcmp(name, event_names[i]) != 0) ++i;
+        if (i == sizeof(event_names) / sizeof(event_names[0])) return -1;
+        *kinds |= 1u << i;
     }
-    if (ftruncate(shm_fd, sizeof(shared_data_t)) == -1) {
-        perror("ftruncate");
-        return EXIT_FAILURE;
+    return *kinds ? 0 : -1;
+}
+
+// Диапазон болтунов: "A-B" или один номер "A".
+static int parse_range(const char *text, exchange_filter_t *filter) {
+    char *end;
+    unsigned long first = strtoul(text, &end, 10);
+    unsigned long last = first;
+    if (end == text) return -1;
+    if (*end == '-') {
+        const char *rest = end + 1;
+        last = strtoul(rest, &end, 10);
+        if (end == rest) return -1;
     }
-    shared_data_t *shared = mmap(NULL, sizeof(shared_data_t), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-    if (shared == MAP_FAILED) {
-        perror("mmap");
-        return EXIT_FAILURE;
+    if (*end != '\0' || first > last || last > UINT32_MAX) return -1;
+    filter->key_min = (uint32_t)first;
+    filter->key_max = (uint32_t)last;
+    return 0;
+}
+
+static void describe_filter(const exchange_filter_t *filter, char *buffer, size_t size) {
+    size_t len = 0;
+    buffer[0] = '\0';
+    if (filter->key_min != 0 || filter->key_max != UINT32_MAX) {
+        len += (size_t)snprintf(buffer + len, size - len, "болтуны %u-%u ", filter->key_min, filter->key_max);
+    }
+    if (filter->keys && len < size) {
+        len += (size_t)snprintf(buffer + len, size - len, "маска %#llx ", (unsigned long long)filter->keys);
+    }
+    if (filter->kinds && len < size) {
+        len += (size_t)snprintf(buffer + len, size - len, "события");
+        for (size_t i = 0; i < sizeof(event_names) / sizeof(event_names[0]) && len < size; ++i) {
+            if (filter->kinds & (1u << i)) len += (size_t)snprintf(buffer + len, size - len, " %s", event_names[i]);
+        }
+    }
+    if (len == 0) snprintf(buffer, size, "все события");
+}
+
+// Таблица наблюдателей со счётчиками из разделяемой памяти.
+static void list_observers(exchange_t *shared) {
+    exchange_log_t *log = exchange_log(shared);
+    unsigned limit = atomic_load(&log->observer_limit);
+    char text[192];
+    printf("слот      pid     курсор     прошло    отсеяно  пропущено  фильтр\n");
+    for (unsigned i = 0; i < limit && i < LOG_MAX_OBSERVERS; ++i) {
+        exchange_observer_t *obs = &log->observers[i];
+        int pid = atomic_load(&obs->pid);
+        if (pid <= 0) continue;
+        describe_filter(&obs->filter, text, sizeof(text));
+        printf("%4u %8d %10lu %10lu %10lu %10lu  %s\n", i, pid, atomic_load(&obs->cursor), atomic_load(&obs->matched),
+               atomic_load(&obs->filtered), atomic_load(&obs->skipped), text);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Использование: %s [--record файл] [--talkers A-B] [--talker-mask M] [--events start,call,hangup,exit,stop] [--list] [--snapshot]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    const char *record_path = NULL;
+    exchange_filter_t filter = { .key_max = UINT32_MAX };
+    int do_list = 0;
+    int do_snapshot = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--talkers") == 0 && i + 1 < argc && parse_range(argv[i + 1], &filter) == 0) {
+            ++i;
+        } else if (strcmp(argv[i], "--talker-mask") == 0 && i + 1 < argc) {
+            filter.keys = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--events") == 0 && i + 1 < argc && parse_events(argv[i + 1], &filter.kinds) == 0) {
+            ++i;
+        } else if (strcmp(argv[i], "--list") == 0) {
+            do_list = 1;
+        } else if (strcmp(argv[i], "--snapshot") == 0) {
+            do_snapshot = 1;
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
     }
-    close(shm_fd);
 
-    sem_t *log_sem = sem_open(LOG_SEM, O_CREAT, 0666, 1);
-    if (log_sem == SEM_FAILED) {
-        perror("sem_open log");
+    // Без SA_RESTART сигнал прерывает ожидание на futex.
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigint;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+
+    exchange_t *shared = exchange_attach(SHM_NAME);
+    if (!shared) {
+        return EXIT_FAILURE;
+    }
+    exchange_log_t *log = exchange_log(shared);
+    if (!log) {
+        fprintf(stderr, "В сегменте %s нет журнала событий\n", SHM_NAME);
         return EXIT_FAILURE;
     }
-    sem_t *print_sem = sem_open(PRINT_SEM, O_CREAT, 0666, 1);
-    if (print_sem == SEM_FAILED) {
-        perror("sem_open print");
+    if (exchange_log_payload(shared) < sizeof(event_record_t)) {
+        fprintf(stderr, "Слоты журнала в %s меньше записи события\n", SHM_NAME);
         return EXIT_FAILURE;
     }
+    if (do_list || do_snapshot) {
+        if (do_list) list_observers(shared);
+        if (do_snapshot) exchange_calls_report(shared, stdout);
+        exchange_detach(shared);
+        return EXIT_SUCCESS;
+    }
+    // Каждое полученное событие дописывается в журнал на диске.
+    journal_t journal = {0};
+    if (record_path) {
+        if (journal_open(&journal, record_path, 1) == -1) {
+            return EXIT_FAILURE;
+        }
+        printf("Запись событий в %s (уже записано %llu)\n", record_path, (unsigned long long)journal.count);
+    }
+    event_record_t event;
+    char text[192];
 
-    unsigned long last_seq = 0;
-    printf("Наблюдатель подключён, текущая очередь: %lu сообщений.\n", shared->seq);
+    unsigned long cursor = 0;
+    unsigned long head = ring_head(shared);
+    if (head > shared->log_capacity) cursor = head - shared->log_capacity;
+    int slot = ring_observer_register(shared, cursor, &filter);
+    if (slot < 0) {
+        fprintf(stderr, "Подключено максимальное число наблюдателей (%d)\n", LOG_MAX_OBSERVERS);
+        journal_close(&journal);
+        return EXIT_FAILURE;
+    }
+    exchange_observer_t *self = &log->observers[slot];
+    describe_filter(&filter, text, sizeof(text));
+    printf("Наблюдатель #%d подключён (%s, %s), текущая очередь: %lu сообщений.\n",
+           slot, log->backpressure == RING_BLOCK ? "болтуны ждут отстающих" : "отстающие теряют события", text, head - cursor);
 
+    unsigned long received = 0, filtered = 0, pending_skip = 0;
+    long long stalled_since = 0;
     while (!stop_requested) {
-        if (shared->stop_flag && last_seq >= shared->seq) {
+        head = ring_head(shared);
+        if (shared->stop_flag && cursor >= head) {
             break;
         }
+        if (cursor < head && head - cursor > shared->log_capacity) {
+            pending_skip += head - shared->log_capacity - cursor;
+            cursor = head - shared->log_capacity;
+            ring_observer_advance(shared, slot, cursor);
+        }
 
-        if (last_seq < shared->seq) {
-            sem_wait(log_sem);
-            while (last_seq < shared->seq) {
-                unsigned long index = last_seq % LOG_CAP;
-                char message[LOG_LEN];
-                snprintf(message, sizeof(message), "%s", shared->log_buffer[index]);
-                sem_wait(print_sem);
-                printf("[OBS4] %s", message);
-                fflush(stdout);
-                sem_post(print_sem);
-                last_seq++;
+        int rc = cursor < head ? ring_read_filtered(shared, cursor, &filter, &event, sizeof(event)) : RING_READ_PENDING;
+        if (rc == RING_READ_FILTERED) {
+            // Счётчики пишет только сам наблюдатель, атомарный инкремент не нужен.
+            atomic_store_explicit(&self->filtered, ++filtered, memory_order_relaxed);
+            if (++cursor % FILTER_PUBLISH_EVERY == 0) ring_observer_advance(shared, slot, cursor);
+            stalled_since = 0;
+        } else if (rc == RING_READ_OK) {
+            report_skipped(self, &pending_skip);
+            event_render(&event, text, sizeof(text));
+            printf("[OBS4] %s", text);
+            fflush(stdout);
+            atomic_store_explicit(&self->matched, ++received, memory_order_relaxed);
+            if (record_path && journal_append(&journal, &event) == -1) {
+                break;
             }
-            sem_post(log_sem);
+            ring_observer_advance(shared, slot, ++cursor);
+            stalled_since = 0;
+        } else if (rc == RING_READ_OVERWRITTEN) {
+            pending_skip++;
+            ring_observer_advance(shared, slot, ++cursor);
+            stalled_since = 0;
+        } else if (cursor >= head) {
+            report_skipped(self, &pending_skip);
+            fflush(stdout);
+            ring_observer_advance(shared, slot, cursor);
+            ring_wait(shared, cursor, -1);
         } else {
-            usleep(150000);
+            // Производитель ещё пишет слот; если он так и не дописал (например,
+            // был убит), слот пропускается, чтобы не стоять на нём вечно.
+            long long now = ring_now_ms();
+            if (!stalled_since) {
+                stalled_since = now;
+            } else if (now - stalled_since >= STALL_LIMIT_MS) {
+                pending_skip++;
+                ring_observer_advance(shared, slot, ++cursor);
+                stalled_since = 0;
+                continue;
+            }
+            ring_observer_advance(shared, slot, cursor);
+            ring_wait(shared, cursor, STALL_LIMIT_MS);
         }
     }
 
-    sem_close(log_sem);
-    sem_close(print_sem);
-    munmap(shared, sizeof(shared_data_t));
+    report_skipped(self, &pending_skip);
+    printf("Наблюдатель #%d: получено %lu, отсеяно фильтром %lu, пропущено %lu событий\n", slot, received, filtered,
+           atomic_load(&self->skipped));
+    if (record_path) {
+        printf("В журнале %s: %llu событий\n", record_path, (unsigned long long)journal.count);
+        journal_close(&journal);
+    }
+    ring_observer_unregister(shared, slot);
+    exchange_detach(shared);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,117 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "event.h"
+#include "exchange.h"
+#include "journal.h"
+#include "ring.h"
+
+#define SHM_NAME "/talker4_shared"
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_sigint(int signo) {
+    (void)signo;
+    stop_requested = 1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Использование: %s [--speed X | --max] [--stop] <журнал>\n", prog);
+}
+
+// Спит до момента start_ns + offset_ns по CLOCK_MONOTONIC.
+static void sleep_until(uint64_t start_ns, uint64_t offset_ns) {
+    uint64_t target = start_ns + offset_ns;
+    struct timespec ts = { (time_t)(target / 1000000000ull), (long)(target % 1000000000ull) };
+    while (!stop_requested && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = NULL;
+    double speed = 1.0; // 0 — без пауз
+    int stop_after = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            speed = atof(argv[++i]);
+            if (speed <= 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--max") == 0) {
+            speed = 0;
+        } else if (strcmp(argv[i], "--stop") == 0) {
+            stop_after = 1;
+        } else if (argv[i][0] != '-' && !path) {
+            path = argv[i];
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!path) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigint;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+
+    journal_t journal;
+    if (journal_open(&journal, path, 0) == -1) {
+        return EXIT_FAILURE;
+    }
+    exchange_t *shared = exchange_attach(SHM_NAME);
+    if (!shared) {
+        journal_close(&journal);
+        return EXIT_FAILURE;
+    }
+    if (!exchange_log(shared) || exchange_log_payload(shared) < sizeof(event_record_t)) {
+        fprintf(stderr, "В сегменте %s нет подходящего журнала событий\n", SHM_NAME);
+        exchange_detach(shared);
+        journal_close(&journal);
+        return EXIT_FAILURE;
+    }
+    if (shared->stop_flag) {
+        fprintf(stderr, "Станция %s остановлена, выполните ./talker4 --init\n", SHM_NAME);
+        exchange_detach(shared);
+        journal_close(&journal);
+        return EXIT_FAILURE;
+    }
+
+    // Записи идут в исходном виде; паузы между ними берутся из меток времени.
+    const event_record_t *records = journal_records(&journal);
+    uint64_t total = journal.count;
+    uint64_t first_ns = total > 0 ? records[0].timestamp_ns : 0;
+    uint64_t start_ns = event_now_ns();
+    uint64_t sent = 0;
+    printf("Воспроизведение %s: %llu событий\n", path, (unsigned long long)total);
+
+    for (; sent < total && !stop_requested && !shared->stop_flag; ++sent) {
+        const event_record_t *ev = &records[sent];
+        if (speed > 0 && ev->timestamp_ns > first_ns) {
+            sleep_until(start_ns, (uint64_t)((double)(ev->timestamp_ns - first_ns) / speed));
+            if (stop_requested) break;
+        }
+        ring_append(shared, ev, sizeof(*ev), (uint32_t)ev->talker, ev->type);
+    }
+
+    double elapsed = (double)(event_now_ns() - start_ns) / 1e9;
+    printf("Отправлено %llu из %llu событий за %.3f c (%.0f событий/c)\n",
+           (unsigned long long)sent, (unsigned long long)total, elapsed, elapsed > 0 ? sent / elapsed : 0.0);
+    if (stop_after) {
+        shared->stop_flag = 1;
+        ring_wake_all(shared);
+    }
+    exchange_detach(shared);
+    journal_close(&journal);
+    return EXIT_SUCCESS;
+}
@@ -11,127 +11,165 @@
 #include <string.h>
 #include <semaphore.h>
 
-#define MAX_BOLTUNS 64
-#define LOG_CAP 256
-#define LOG_LEN 180
+#include "async_log.h"
+#include "event.h"
+#include "exchange.h"
+#include "prng.h"
+#include "ring.h"
+#include "reserve.h"
+
+#define DEFAULT_BOLTUNS 5
+#define LOG_CAP 1024
+#define LOG_MIN_CAP 16
+#define ENTRY_SIZE (sizeof(exchange_log_slot_t) + sizeof(event_record_t))
 #define SHM_NAME "/talker4_shared"
-#define DATA_SEM "/talker4_data_sem"
 #define PRINT_SEM "/talker4_print_sem"
-#define LOG_SEM "/talker4_log_sem"
-
-typedef struct {
-    int num_boltuns;
-    int next_id;
-    int busy[MAX_BOLTUNS];
-    int stop_flag;
-    unsigned long seq;
-    char log_buffer[LOG_CAP][LOG_LEN];
-} shared_data_t;
-
-static sem_t *data_sem = NULL;
+
 static sem_t *print_sem = NULL;
-static sem_t *log_sem = NULL;
-static shared_data_t *shared = NULL;
+static exchange_t *shared = NULL;
+static talker_stats_t *stats = NULL;
 static volatile sig_atomic_t terminate_requested = 0;
+static int pick_free = 0;
+static int call_wait_ms = 0;
+static uint64_t base_seed;
+static prng_t rng;
+static uint32_t backpressure = RING_DROP;
+static uint32_t block_timeout_ms = 200;
+static uint32_t log_capacity = LOG_CAP;
+static uint32_t map_flags = EXCHANGE_MAP_PREFAULT;
 
 static void handle_sigint(int signo) {
     (void)signo;
     terminate_requested = 1;
-    if (shared) shared->stop_flag = 1;
+    if (shared) {
+        shared->stop_flag = 1;
+        ring_wake_all(shared);
+    }
 }
 
 static int random_between(int min, int max) {
-    if (max <= min) return min;
-    return min + rand() % (max - min + 1);
+    return prng_between(&rng, min, max);
 }
 
-static void append_log(const char *fmt, ...) {
-    char buffer[LOG_LEN];
+// Строка уходит в буфер процесса, print_sem берёт только поток вывода.
+static void print_local(const char *fmt, ...) {
     va_list args;
-
     va_start(args, fmt);
-    vsnprintf(buffer, sizeof(buffer), fmt, args);
+    async_log_vprintf(fmt, args);
     va_end(args);
+}
 
-    sem_wait(log_sem);
-    unsigned long index = shared->seq % LOG_CAP;
-    snprintf(shared->log_buffer[index], LOG_LEN, "%s", buffer);
-    shared->seq++;
-    sem_post(log_sem);
+// В кольцо попадает двоичная запись, текст строится только для своей консоли.
+static void append_log(int type, int id, int target, int duration) {
+    event_record_t ev = event_make(type, id, target, duration);
+    char text[128];
 
-    sem_wait(print_sem);
-    printf("%s", buffer);
-    fflush(stdout);
-    sem_post(print_sem);
+    if (stats && exchange_log(shared)->backpressure == RING_BLOCK) {
+        // В режиме block болтун может ждать отстающего наблюдателя.
+        long long wait_start = stats_now_ns();
+        ring_append(shared, &ev, sizeof(ev), (uint32_t)ev.talker, ev.type);
+        stats_add(&stats->wait_ns, (unsigned long)(stats_now_ns() - wait_start));
+    } else {
+        ring_append(shared, &ev, sizeof(ev), (uint32_t)ev.talker, ev.type);
+    }
+    if (type == EVENT_EXIT) return;
+    event_render(&ev, text, sizeof(text));
+    print_local("%s", text);
+}
+
+static int pick_target(int id) {
+    int capacity = (int)shared->capacity;
+    if (pick_free) {
+        return phone_bits_pick_free(exchange_busy(shared), capacity, id, (unsigned long)prng_next(&rng));
+    }
+    int target = id;
+    int attempts = 0;
+    while (target == id && attempts < 4 * capacity) {
+        target = (int)prng_below(&rng, (uint32_t)capacity);
+        attempts++;
+    }
+    return target;
 }
 
 static int acquire_id(void) {
-    sem_wait(data_sem);
-    int id = shared->next_id % shared->num_boltuns;
+    long long wait_start = stats_now_ns();
+    uint64_t acquired = exchange_lock(shared);
+    long long waited = (long long)acquired - wait_start;
+    int id = shared->next_id % (int)shared->capacity;
     shared->next_id++;
-    sem_post(data_sem);
+    exchange_unlock(shared, acquired);
+
+    stats = exchange_stats(shared, id);
+    stats_begin(stats);
+    stats_add(&stats->wait_ns, (unsigned long)waited);
     return id;
 }
 
-static void init_shared(int boltuns) {
-    int shm_fd = shm_open(SHM_NAME, O_CREAT | O_RDWR, 0666);
-    if (shm_fd == -1) {
-        perror("shm_open");
-        exit(EXIT_FAILURE);
+static exchange_layout_t make_layout(int boltuns) {
+    exchange_layout_t layout = {
+        .capacity = (uint32_t)boltuns,
+        .log_capacity = log_capacity,
+        .log_entry_size = ENTRY_SIZE,
+        .backpressure = backpressure,
+        .block_timeout_ms = block_timeout_ms,
+        .map_flags = map_flags,
+    };
+    return layout;
+}
+
+// Ёмкость кольца: число событий или объём с суффиксом K/M (например, 64M).
+static int parse_ring(const char *text, uint32_t *capacity) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text) return -1;
+    unsigned long long events = value;
+    if (*end == 'K' || *end == 'k' || *end == 'M' || *end == 'm') {
+        unsigned long long unit = (*end == 'K' || *end == 'k') ? 1024ull : 1024ull * 1024;
+        if (value > ULLONG_MAX / unit) return -1;
+        events = value * unit / ((ENTRY_SIZE + 7) & ~(size_t)7);
+        end++;
+        if (*end == 'B' || *end == 'b') end++;
     }
-    if (ftruncate(shm_fd, sizeof(shared_data_t)) == -1) {
-        perror("ftruncate");
-        exit(EXIT_FAILURE);
+    if (*end != '\0' || events < LOG_MIN_CAP || events > UINT32_MAX) return -1;
+    *capacity = (uint32_t)events;
+    return 0;
+}
+
+static void init_shared(int boltuns) {
+    if ((map_flags & EXCHANGE_MAP_HUGE) && !exchange_huge_available()) {
+        fprintf(stderr, "Огромные страницы для shmem выключены (/sys/kernel/mm/transparent_hugepage/shmem_enabled), "
+                        "используются обычные\n");
+        map_flags &= ~(uint32_t)EXCHANGE_MAP_HUGE;
     }
-    shared_data_t *mem = mmap(NULL, sizeof(shared_data_t), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-    if (mem == MAP_FAILED) {
-        perror("mmap");
+    exchange_layout_t layout = make_layout(boltuns);
+    if (exchange_create(SHM_NAME, &layout, 0) == -1) {
         exit(EXIT_FAILURE);
     }
-    memset(mem, 0, sizeof(shared_data_t));
-    mem->num_boltuns = boltuns;
-    munmap(mem, sizeof(shared_data_t));
-    close(shm_fd);
+    exchange_t *ex = exchange_attach(SHM_NAME);
+    if (!ex) exit(EXIT_FAILURE);
+    fprintf(stderr, "Кольцо: %u событий по %u байт, сегмент %.1f МБ размечен заранее%s\n", ex->log_capacity,
+            ex->log_entry_size, ex->size / (1024.0 * 1024.0), (ex->map_flags & EXCHANGE_MAP_HUGE) ? ", огромные страницы" : "");
+    exchange_detach(ex);
 }
 
 static void open_shared(void) {
-    int shm_fd = shm_open(SHM_NAME, O_CREAT | O_RDWR, 0666);
-    if (shm_fd == -1) {
-        perror("shm_open");
-        exit(EXIT_FAILURE);
-    }
-    if (ftruncate(shm_fd, sizeof(shared_data_t)) == -1) {
-        perror("ftruncate");
-        exit(EXIT_FAILURE);
-    }
-    shared = mmap(NULL, sizeof(shared_data_t), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-    if (shared == MAP_FAILED) {
-        perror("mmap");
+    // Без --init сегмент создаётся с настройками по умолчанию, если его ещё нет.
+    exchange_layout_t layout = make_layout(DEFAULT_BOLTUNS);
+    shared = exchange_open(SHM_NAME, &layout);
+    if (!shared) {
         exit(EXIT_FAILURE);
     }
-    close(shm_fd);
-    if (shared->num_boltuns <= 0 || shared->num_boltuns > MAX_BOLTUNS) {
-        shared->num_boltuns = 5;
-    }
 }
 
 static void cleanup_resources(int unlink_all) {
     if (shared) {
-        munmap(shared, sizeof(shared_data_t));
+        exchange_detach(shared);
         shared = NULL;
     }
-    if (data_sem) {
-        sem_close(data_sem);
-        if (unlink_all) sem_unlink(DATA_SEM);
-    }
     if (print_sem) {
         sem_close(print_sem);
         if (unlink_all) sem_unlink(PRINT_SEM);
     }
-    if (log_sem) {
-        sem_close(log_sem);
-        if (unlink_all) sem_unlink(LOG_SEM);
-    }
     if (unlink_all) {
         shm_unlink(SHM_NAME);
     }
@@ -139,58 +177,72 @@ static void cleanup_resources(int unlink_all) {
 
 static void run_boltun(int min_pause, int max_pause, int min_talk, int max_talk, int duration) {
     int id = acquire_id();
-    srand((unsigned)time(NULL) ^ (getpid()<<16));
-    append_log("[%d] стартовал (болтунов=%d)\n", id, shared->num_boltuns);
+    prng_seed(&rng, base_seed, (uint64_t)id);
+    append_log(EVENT_START, id, (int)shared->capacity, 0);
 
+    // Аренда покрывает самый длинный разговор; после неё телефоны может забрать сборщик.
+    pid_t pid = getpid();
+    uint32_t lease_ms = (uint32_t)max_talk * 1000 + EXCHANGE_LEASE_GRACE_MS;
+    unsigned long attempts = 0, wasted = 0;
     time_t start = time(NULL);
     while (!terminate_requested && !shared->stop_flag && (time(NULL) - start < duration)) {
         int pause = random_between(min_pause, max_pause);
         sleep(pause);
         if (terminate_requested || shared->stop_flag) break;
 
-        int target = id;
-        int attempts = 0;
-        while (target == id && attempts < 4 * shared->num_boltuns) {
-            target = rand() % shared->num_boltuns;
-            attempts++;
-        }
-
-        sem_wait(data_sem);
-        if (shared->stop_flag || shared->busy[id] || shared->busy[target] || target == id) {
-            sem_post(data_sem);
+        exchange_reap_due(shared);
+        int target = pick_target(id);
+        if (shared->stop_flag) break;
+        attempts++;
+        stats_add(&stats->attempts, 1);
+        // С --call-wait звонящий не уходит на новую паузу, а ждёт отбоя абонента.
+        if (target < 0 || (!exchange_reserve_pair(shared, id, target, pid, lease_ms) &&
+                           (call_wait_ms <= 0 || !exchange_wait_call(shared, id, target, pid, lease_ms, call_wait_ms)))) {
+            wasted++;
+            stats_add(&stats->busy, 1);
             continue;
         }
-        shared->busy[id] = 1;
-        shared->busy[target] = 1;
-        sem_post(data_sem);
+        if (shared->stop_flag) {
+            exchange_release_pair(shared, id, target, pid);
+            break;
+        }
 
-        append_log("[%d] звонит %d (пауза %d c)\n", id, target, pause);
+        exchange_call_begin(shared, id, target);
+        append_log(EVENT_CALL, id, target, pause);
         int talk_time = random_between(min_talk, max_talk);
         sleep(talk_time);
 
-        sem_wait(data_sem);
-        shared->busy[id] = 0;
-        shared->busy[target] = 0;
-        sem_post(data_sem);
+        exchange_call_end(shared, id, target);
+        exchange_release_pair(shared, id, target, pid);
 
-        append_log("[%d] закончил разговор с %d за %d c\n", id, target, talk_time);
+        stats_add(&stats->calls, 1);
+        stats_add(&stats->talk_ms, (unsigned long)talk_time * 1000);
+        append_log(EVENT_HANGUP, id, target, talk_time);
     }
 
-    append_log("[%d] завершает работу\n", id);
+    append_log(EVENT_EXIT, id, -1, 0);
+    print_local("[%d] завершает работу (попыток %lu, впустую %lu, откатов резервирования: %lu)\n",
+                id, attempts, wasted, atomic_load(&shared->rollbacks));
+    stats_end(stats);
 
-    sem_wait(data_sem);
+    uint64_t acquired = exchange_lock(shared);
     shared->stop_flag = 1;
-    sem_post(data_sem);
+    exchange_unlock(shared, acquired);
+    ring_wake_all(shared);
 }
 
 static void usage(const char *prog) {
-    fprintf(stderr, "Использование: %s [--init N] [--cleanup] [--duration sec] [мин_пауза макс_пауза мин_разговор макс_разговор]\n", prog);
+    fprintf(stderr, "Использование: %s [--init N] [--cleanup] [--stats] [--locks] [--snapshot] [--duration sec] [--pick random|free] [--seed S] [--call-wait ms] [--backpressure drop|block] [--block-timeout ms] [--ring N|NM] [--hugepages] [мин_пауза макс_пауза мин_разговор макс_разговор]\n", prog);
 }
 
 int main(int argc, char *argv[]) {
     int boltuns = 5;
     int do_init = 0;
     int do_cleanup = 0;
+    int show_stats = 0;
+    int show_locks = 0;
+    int show_snapshot = 0;
+    int seed_given = 0;
     int duration = 25;
     int min_pause = 1, max_pause = 3, min_talk = 1, max_talk = 4;
 
@@ -200,8 +252,46 @@ int main(int argc, char *argv[]) {
             boltuns = atoi(argv[++i]);
         } else if (strcmp(argv[i], "--cleanup") == 0) {
             do_cleanup = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            show_stats = 1;
+        } else if (strcmp(argv[i], "--locks") == 0) {
+            show_locks = 1;
+        } else if (strcmp(argv[i], "--snapshot") == 0) {
+            show_snapshot = 1;
         } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
             duration = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--backpressure") == 0 && i + 1 < argc) {
+            const char *policy = argv[++i];
+            if (strcmp(policy, "block") == 0) {
+                backpressure = RING_BLOCK;
+            } else if (strcmp(policy, "drop") == 0) {
+                backpressure = RING_DROP;
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--ring") == 0 && i + 1 < argc) {
+            if (parse_ring(argv[++i], &log_capacity) == -1) {
+                fprintf(stderr, "Некорректная ёмкость кольца: %s (от %d до %u событий)\n", argv[i], LOG_MIN_CAP, UINT32_MAX);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--hugepages") == 0) {
+            map_flags |= EXCHANGE_MAP_HUGE;
+        } else if (strcmp(argv[i], "--block-timeout") == 0 && i + 1 < argc) {
+            block_timeout_ms = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--call-wait") == 0 && i + 1 < argc) {
+            call_wait_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            base_seed = strtoull(argv[++i], NULL, 0);
+            seed_given = 1;
+        } else if (strcmp(argv[i], "--pick") == 0 && i + 1 < argc) {
+            const char *policy = argv[++i];
+            if (strcmp(policy, "free") == 0) {
+                pick_free = 1;
+            } else if (strcmp(policy, "random") != 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
         } else if (min_pause == 1 && i + 3 < argc) {
             min_pause = atoi(argv[i]);
             max_pause = atoi(argv[i + 1]);
@@ -214,29 +304,38 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    // --stats, --locks и --snapshot только читают состояние работающей станции.
+    if (show_stats || show_locks || show_snapshot) {
+        shared = exchange_attach(SHM_NAME);
+        if (!shared) return EXIT_FAILURE;
+        if (show_stats) exchange_stats_report(shared, stdout);
+        if (show_locks) exchange_lockstat_report(shared, stdout);
+        if (show_snapshot) exchange_calls_report(shared, stdout);
+        exchange_detach(shared);
+        return EXIT_SUCCESS;
+    }
+
     if (do_init) {
+        if (boltuns < 2 || boltuns > EXCHANGE_MAX_PHONES) {
+            fprintf(stderr, "Некорректное число болтунов (допустимо 2..%d)\n", EXCHANGE_MAX_PHONES);
+            return EXIT_FAILURE;
+        }
         init_shared(boltuns);
     }
 
-    data_sem = sem_open(DATA_SEM, O_CREAT, 0666, 1);
-    if (data_sem == SEM_FAILED) {
-        perror("sem_open data");
-        return EXIT_FAILURE;
-    }
     print_sem = sem_open(PRINT_SEM, O_CREAT, 0666, 1);
     if (print_sem == SEM_FAILED) {
         perror("sem_open print");
         return EXIT_FAILURE;
     }
-    log_sem = sem_open(LOG_SEM, O_CREAT, 0666, 1);
-    if (log_sem == SEM_FAILED) {
-        perror("sem_open log");
-        return EXIT_FAILURE;
-    }
 
     open_shared();
+    if (!seed_given) base_seed = prng_default_seed();
+    fprintf(stderr, "Зерно: %llu\n", (unsigned long long)base_seed);
+    if (async_log_start(print_sem, &shared->locks[EXCHANGE_LOCK_PRINT]) != 0) return EXIT_FAILURE;
     signal(SIGINT, handle_sigint);
     run_boltun(min_pause, max_pause, min_talk, max_talk, duration);
+    async_log_stop();
 
     cleanup_resources(do_cleanup);
     return EXIT_SUCCESS;
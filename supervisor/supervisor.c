@@ -0,0 +1,587 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <unistd.h>
+#include <mqueue.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "exchange.h"
+#include "ring.h"
+
+/*
+ * Супервизор станции программ 2–4. Первый болтун запускается с --init и
+ * создаёт сегмент, после этого стартуют наблюдатели и остальные болтуны.
+ * Вывод всех процессов идёт через каналы и печатается строками с меткой
+ * процесса. Упавшие процессы можно перезапускать. При завершении сначала
+ * останавливаются болтуны, затем наблюдатели дочитывают события, затем
+ * удаляются сегмент, семафоры и очереди.
+ */
+#define MAX_CHILDREN 256
+#define MAX_CPUS 256
+#define MAX_EXTRA_ARGS 32
+#define LINE_CAP 512
+#define MAX_RESTARTS 5
+#define RESTART_DELAY_MS 500
+#define READY_TIMEOUT_MS 5000
+#define TALKER_GRACE_MS 5000
+#define OBSERVER_GRACE_MS 3000
+#define KILL_GRACE_MS 2000
+#define MQ_MAX_SHARDS 64
+
+extern char **environ;
+
+// Пути относительно корня репозитория; имена ресурсов совпадают с программами.
+typedef struct {
+    const char *talker;
+    const char *observer;
+    int max_observers;
+    const char *shm_name;
+    const char *print_sem;
+    const char *mq_name;
+} station_t;
+
+static const station_t stations[] = {
+    { "program2/talker2", NULL, 0, "/talker_shared", "/talker_print_sem", NULL },
+    // Наблюдатели программы 3 делили бы одну очередь, поэтому он один.
+    { "program3/talker3", "program3/observer3", 1, "/talker3_shared", "/talker3_print_sem", "/talker3_queue" },
+    { "program4/talker4", "program4/observer4", LOG_MAX_OBSERVERS, "/talker4_shared", "/talker4_print_sem", NULL },
+};
+
+enum { ROLE_TALKER, ROLE_OBSERVER };
+enum { PHASE_RUN, PHASE_STOP_TALKERS, PHASE_STOP_OBSERVERS, PHASE_DONE };
+
+typedef struct {
+    int role;
+    int index;
+    pid_t pid;          // 0 — процесс не работает
+    int out;            // канал с выводом процесса, -1 — закрыт
+    int cpu;            // -1 — без привязки
+    int restarts;
+    long long restart_at; // 0 — перезапуск не нужен
+    size_t used;
+    char line[LINE_CAP];
+} child_t;
+
+static volatile sig_atomic_t stop_requests = 0;
+static const station_t *station;
+static char root[PATH_MAX];
+static char *extra_args[MAX_EXTRA_ARGS];
+static int extra_count = 0;
+static int talkers = 4;
+static int phones = 0;
+static int duration = 0;
+static child_t children[MAX_CHILDREN];
+static int child_count = 0;
+
+static void handle_stop(int signo) {
+    (void)signo;
+    stop_requests++;
+}
+
+static void handle_child(int signo) {
+    (void)signo;
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void note(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    fputs("[S] ", stdout);
+    vprintf(fmt, args);
+    va_end(args);
+    fflush(stdout);
+}
+
+static const char *role_name(const child_t *c) {
+    return c->role == ROLE_TALKER ? "болтун" : "наблюдатель";
+}
+
+// Корень репозитория — каталог над supervisor/, где лежит бинарник.
+static int find_root(void) {
+    ssize_t len = readlink("/proc/self/exe", root, sizeof(root) - 1);
+    if (len <= 0) {
+        perror("readlink");
+        return -1;
+    }
+    root[len] = '\0';
+    for (int up = 0; up < 2; ++up) {
+        char *slash = strrchr(root, '/');
+        if (!slash) return -1;
+        *slash = '\0';
+    }
+    return 0;
+}
+
+static int parse_cpus(const char *list, int *cpus) {
+    int count = 0;
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p) return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) return -1;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) return -1;
+        for (long cpu = first; cpu <= last && count < MAX_CPUS; ++cpu) {
+            cpus[count++] = (int)cpu;
+        }
+        if (*end == ',') end++;
+        else if (*end != '\0') return -1;
+        p = end;
+    }
+    return count;
+}
+
+// Удаляет ресурсы станции; выполняется до запуска и после остановки.
+static void cleanup_station(void) {
+    shm_unlink(station->shm_name);
+    sem_unlink(station->print_sem);
+    if (station->mq_name) {
+        char name[64];
+        for (int shard = 0; shard < MQ_MAX_SHARDS; ++shard) {
+            snprintf(name, sizeof(name), "%s_%d", station->mq_name, shard);
+            mq_unlink(name);
+        }
+    }
+}
+
+static int spawn_child(child_t *c, int init) {
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/%s", root, c->role == ROLE_TALKER ? station->talker : station->observer);
+    char init_arg[16], duration_arg[16];
+    char *argv[MAX_EXTRA_ARGS + 8];
+    int argc = 0;
+    argv[argc++] = path;
+    if (c->role == ROLE_TALKER) {
+        if (init) {
+            snprintf(init_arg, sizeof(init_arg), "%d", phones);
+            argv[argc++] = "--init";
+            argv[argc++] = init_arg;
+        }
+        if (duration > 0) {
+            snprintf(duration_arg, sizeof(duration_arg), "%d", duration);
+            argv[argc++] = "--duration";
+            argv[argc++] = duration_arg;
+        }
+        for (int i = 0; i < extra_count; ++i) {
+            argv[argc++] = extra_args[i];
+        }
+    }
+    argv[argc] = NULL;
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        return -1;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+
+    // Своя группа процессов: Ctrl+C получает только супервизор и
+    // останавливает станцию по порядку.
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t mask, defaults;
+    sigemptyset(&mask);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGTERM);
+    sigaddset(&defaults, SIGCHLD);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+    // posix_spawn не задаёт привязку к CPU, поэтому потомок наследует её
+    // от супервизора на время запуска.
+    cpu_set_t saved;
+    if (c->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(c->cpu, &set);
+        sched_getaffinity(0, sizeof(saved), &saved);
+        if (sched_setaffinity(0, sizeof(set), &set) == -1) perror("sched_setaffinity");
+    }
+    int rc = posix_spawn(&c->pid, path, &actions, &attr, argv, environ);
+    if (c->cpu >= 0) sched_setaffinity(0, sizeof(saved), &saved);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (rc != 0) {
+        fprintf(stderr, "posix_spawn %s: %s\n", path, strerror(rc));
+        close(fds[0]);
+        c->pid = 0;
+        return -1;
+    }
+    c->out = fds[0];
+    c->used = 0;
+    c->restart_at = 0;
+    if (c->cpu >= 0) {
+        note("%s %d запущен (pid %d, CPU %d)\n", role_name(c), c->index, (int)c->pid, c->cpu);
+    } else {
+        note("%s %d запущен (pid %d)\n", role_name(c), c->index, (int)c->pid);
+    }
+    return 0;
+}
+
+static void emit_line(const child_t *c, const char *text, size_t len) {
+    printf("[%c%d] %.*s\n", c->role == ROLE_TALKER ? 'T' : 'O', c->index, (int)len, text);
+}
+
+// Печатает полные строки из канала; хвост без '\n' ждёт следующего чтения.
+static void drain_output(child_t *c) {
+    ssize_t n = read(c->out, c->line + c->used, sizeof(c->line) - c->used);
+    if (n < 0 && errno == EINTR) return;
+    if (n <= 0) {
+        if (c->used) emit_line(c, c->line, c->used);
+        c->used = 0;
+        close(c->out);
+        c->out = -1;
+        fflush(stdout);
+        return;
+    }
+    c->used += (size_t)n;
+    size_t start = 0;
+    for (size_t i = 0; i < c->used; ++i) {
+        if (c->line[i] == '\n') {
+            emit_line(c, c->line + start, i - start);
+            start = i + 1;
+        }
+    }
+    if (start == 0 && c->used == sizeof(c->line)) {
+        emit_line(c, c->line, c->used);
+        c->used = 0;
+    } else {
+        memmove(c->line, c->line + start, c->used - start);
+        c->used -= start;
+    }
+    fflush(stdout);
+}
+
+static child_t *find_child(pid_t pid) {
+    for (int i = 0; i < child_count; ++i) {
+        if (children[i].pid == pid) return &children[i];
+    }
+    return NULL;
+}
+
+static void reap_children(int phase, int restart) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        child_t *c = find_child(pid);
+        if (!c) continue;
+        c->pid = 0;
+        int failed = 0;
+        if (WIFSIGNALED(status)) {
+            note("%s %d (pid %d) завершён сигналом %d\n", role_name(c), c->index, (int)pid, WTERMSIG(status));
+            failed = 1;
+        } else if (WEXITSTATUS(status) != 0) {
+            note("%s %d (pid %d) завершился с кодом %d\n", role_name(c), c->index, (int)pid, WEXITSTATUS(status));
+            failed = 1;
+        }
+        if (failed && restart && phase == PHASE_RUN) {
+            if (c->restarts < MAX_RESTARTS) {
+                c->restart_at = now_ms() + RESTART_DELAY_MS;
+            } else {
+                note("%s %d упал %d раз, больше не перезапускается\n", role_name(c), c->index, c->restarts + 1);
+            }
+        }
+    }
+}
+
+static int alive(int role) {
+    int count = 0;
+    for (int i = 0; i < child_count; ++i) {
+        if (children[i].role == role && (children[i].pid || children[i].restart_at)) count++;
+    }
+    return count;
+}
+
+static void signal_role(int role, int signo) {
+    for (int i = 0; i < child_count; ++i) {
+        if (children[i].role != role) continue;
+        children[i].restart_at = 0;
+        if (children[i].pid) kill(children[i].pid, signo);
+    }
+}
+
+static int open_outputs(void) {
+    for (int i = 0; i < child_count; ++i) {
+        if (children[i].out >= 0) return 1;
+    }
+    return 0;
+}
+
+// Ждёт, пока первый болтун создаст сегмент; сегмент до этого удалён, так что
+// найденная сигнатура — новая.
+static exchange_t *wait_exchange(child_t *init) {
+    long long deadline = now_ms() + READY_TIMEOUT_MS;
+    while (now_ms() < deadline && !stop_requests) {
+        int fd = shm_open(station->shm_name, O_RDONLY, 0);
+        if (fd >= 0) {
+            struct stat st;
+            int ready = 0;
+            if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(exchange_t)) {
+                exchange_t *ex = mmap(NULL, sizeof(exchange_t), PROT_READ, MAP_SHARED, fd, 0);
+                if (ex != MAP_FAILED) {
+                    ready = ex->magic == EXCHANGE_MAGIC;
+                    munmap(ex, sizeof(exchange_t));
+                }
+            }
+            close(fd);
+            if (ready) return exchange_attach(station->shm_name);
+        }
+        int status;
+        if (waitpid(init->pid, &status, WNOHANG) == init->pid) {
+            init->pid = 0;
+            break;
+        }
+        struct timespec pause = { 0, 10 * 1000000L };
+        nanosleep(&pause, NULL);
+    }
+    fprintf(stderr, "Первый болтун не создал сегмент %s\n", station->shm_name);
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Использование: %s [--program 2|3|4] [--talkers N] [--phones P] [--observers M] [--duration sec] [--cpus СПИСОК] [--observer-cpus СПИСОК] [--restart] [-- аргументы болтунов]\n", prog);
+    fprintf(stderr, "СПИСОК — номера CPU через запятую и диапазоны, например 0-3,6\n");
+}
+
+int main(int argc, char *argv[]) {
+    int program = 4;
+    int observers = -1;
+    int restart = 0;
+    int talker_cpus[MAX_CPUS], observer_cpus[MAX_CPUS];
+    int talker_cpu_count = 0, observer_cpu_count = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--program") == 0 && i + 1 < argc) {
+            program = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--talkers") == 0 && i + 1 < argc) {
+            talkers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--phones") == 0 && i + 1 < argc) {
+            phones = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--observers") == 0 && i + 1 < argc) {
+            observers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            duration = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cpus") == 0 && i + 1 < argc) {
+            talker_cpu_count = parse_cpus(argv[++i], talker_cpus);
+            if (talker_cpu_count <= 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--observer-cpus") == 0 && i + 1 < argc) {
+            observer_cpu_count = parse_cpus(argv[++i], observer_cpus);
+            if (observer_cpu_count <= 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--restart") == 0) {
+            restart = 1;
+        } else if (strcmp(argv[i], "--") == 0) {
+            for (++i; i < argc && extra_count < MAX_EXTRA_ARGS; ++i) {
+                extra_args[extra_count++] = argv[i];
+            }
+            if (i < argc) {
+                fprintf(stderr, "Слишком много аргументов болтунов (не больше %d)\n", MAX_EXTRA_ARGS);
+                return EXIT_FAILURE;
+            }
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (program < 2 || program > 4) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    station = &stations[program - 2];
+    if (observers < 0) observers = station->max_observers > 0 ? 1 : 0;
+    if (observers > station->max_observers) {
+        fprintf(stderr, "Программа %d допускает не больше %d наблюдателей\n", program, station->max_observers);
+        return EXIT_FAILURE;
+    }
+    if (talkers < 1 || talkers + observers > MAX_CHILDREN) {
+        fprintf(stderr, "Некорректное число процессов (всего не больше %d)\n", MAX_CHILDREN);
+        return EXIT_FAILURE;
+    }
+    // Перезапущенный болтун получает следующий номер, поэтому для перезапусков
+    // стоит заводить номера с запасом.
+    if (phones == 0) phones = talkers < 2 ? 2 : talkers;
+    if (phones < 2 || phones > EXCHANGE_MAX_PHONES) {
+        fprintf(stderr, "Некорректное число номеров (допустимо 2..%d)\n", EXCHANGE_MAX_PHONES);
+        return EXIT_FAILURE;
+    }
+    if (find_root() == -1) {
+        return EXIT_FAILURE;
+    }
+
+    // Сигналы блокируются везде, кроме ppoll, чтобы не потерять их между
+    // проверкой флагов и ожиданием.
+    sigset_t blocked, waiting;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    sigaddset(&blocked, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &blocked, &waiting);
+    sigdelset(&waiting, SIGINT);
+    sigdelset(&waiting, SIGTERM);
+    sigdelset(&waiting, SIGCHLD);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = handle_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = handle_child;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    for (int i = 0; i < talkers; ++i) {
+        child_t *c = &children[child_count++];
+        c->role = ROLE_TALKER;
+        c->index = i;
+        c->out = -1;
+        c->cpu = talker_cpu_count ? talker_cpus[i % talker_cpu_count] : -1;
+    }
+    for (int i = 0; i < observers; ++i) {
+        child_t *c = &children[child_count++];
+        c->role = ROLE_OBSERVER;
+        c->index = i;
+        c->out = -1;
+        c->cpu = observer_cpu_count ? observer_cpus[i % observer_cpu_count] : -1;
+    }
+
+    // Старые семафоры могли остаться занятыми после аварии, поэтому станция
+    // всегда начинается с чистых ресурсов.
+    cleanup_station();
+    int phase = PHASE_RUN;
+    exchange_t *shared = NULL;
+    if (spawn_child(&children[0], 1) == 0) {
+        shared = wait_exchange(&children[0]);
+    }
+    if (shared) {
+        for (int i = talkers; i < child_count; ++i) {
+            if (spawn_child(&children[i], 0) == -1) stop_requests++;
+        }
+        for (int i = 1; i < talkers && !stop_requests; ++i) {
+            if (spawn_child(&children[i], 0) == -1) stop_requests++;
+        }
+    } else {
+        stop_requests++;
+    }
+
+    long long deadline = 0;
+    int escalated = 0;
+    struct pollfd fds[MAX_CHILDREN];
+    child_t *owners[MAX_CHILDREN];
+    while (phase != PHASE_DONE || open_outputs()) {
+        int count = 0;
+        for (int i = 0; i < child_count; ++i) {
+            if (children[i].out < 0) continue;
+            fds[count].fd = children[i].out;
+            fds[count].events = POLLIN;
+            owners[count++] = &children[i];
+        }
+        struct timespec tick = { 0, 100 * 1000000L };
+        int ready = ppoll(fds, (nfds_t)count, &tick, &waiting);
+        if (ready < 0 && errno != EINTR) {
+            perror("ppoll");
+            break;
+        }
+        for (int i = 0; ready > 0 && i < count; ++i) {
+            if (fds[i].revents) drain_output(owners[i]);
+        }
+        reap_children(phase, restart);
+        long long now = now_ms();
+        // Телефоны упавших болтунов возвращаются, даже если живые болтуны спят.
+        if (shared && phase == PHASE_RUN) exchange_reap_due(shared);
+
+        if (phase == PHASE_RUN) {
+            for (int i = 0; i < child_count && !stop_requests; ++i) {
+                child_t *c = &children[i];
+                if (c->restart_at && c->restart_at <= now && c->out < 0) {
+                    c->restarts++;
+                    note("перезапуск: %s %d, попытка %d\n", role_name(c), c->index, c->restarts);
+                    if (spawn_child(c, 0) == -1) c->restart_at = 0;
+                }
+            }
+            if (stop_requests || alive(ROLE_TALKER) == 0) {
+                note("остановка болтунов\n");
+                if (shared) {
+                    shared->stop_flag = 1;
+                    ring_wake_all(shared);
+                }
+                signal_role(ROLE_TALKER, SIGINT);
+                phase = PHASE_STOP_TALKERS;
+                deadline = now + TALKER_GRACE_MS;
+            }
+        } else if (phase == PHASE_STOP_TALKERS) {
+            if (alive(ROLE_TALKER) == 0) {
+                note("болтуны остановлены, наблюдатели дочитывают события\n");
+                phase = PHASE_STOP_OBSERVERS;
+                deadline = now + OBSERVER_GRACE_MS;
+                escalated = 0;
+            } else if (now >= deadline) {
+                note("болтуны не завершились за %d мс, SIGKILL\n", TALKER_GRACE_MS);
+                signal_role(ROLE_TALKER, SIGKILL);
+                deadline = now + KILL_GRACE_MS;
+            }
+        } else if (phase == PHASE_STOP_OBSERVERS) {
+            if (alive(ROLE_OBSERVER) == 0) {
+                phase = PHASE_DONE;
+            } else if (now >= deadline) {
+                signal_role(ROLE_OBSERVER, escalated ? SIGKILL : SIGINT);
+                escalated = 1;
+                deadline = now + KILL_GRACE_MS;
+            }
+        }
+
+        // Повторный Ctrl+C не ждёт корректного завершения.
+        if (stop_requests > 1 && phase != PHASE_DONE && phase != PHASE_RUN) {
+            signal_role(ROLE_TALKER, SIGKILL);
+            signal_role(ROLE_OBSERVER, SIGKILL);
+            stop_requests = 1;
+        }
+    }
+    reap_children(PHASE_DONE, 0);
+
+    if (shared) {
+        exchange_stats_report(shared, stdout);
+        exchange_detach(shared);
+    }
+    cleanup_station();
+    int restarts = 0;
+    for (int i = 0; i < child_count; ++i) {
+        restarts += children[i].restarts;
+    }
+    note("станция остановлена, перезапусков: %d\n", restarts);
+    return shared ? EXIT_SUCCESS : EXIT_FAILURE;
+}